@@ -37,6 +37,24 @@ else
     $(info TARGET_RECOVERY_PIXEL_FORMAT or MR_PIXEL_FORMAT not set or have invalid value)
 endif
 
+# Alpha blending kernels in lib/framebuffer_blend.c: neon, sse2 or scalar.
+# The SIMD ones are used only if the compiler targets that instruction set.
+ifeq ($(MR_BLEND_IMPL),)
+    ifneq ($(filter arm arm64,$(TARGET_ARCH)),)
+        MR_BLEND_IMPL := neon
+    else ifneq ($(filter x86 x86_64,$(TARGET_ARCH)),)
+        MR_BLEND_IMPL := sse2
+    else
+        MR_BLEND_IMPL := scalar
+    endif
+endif
+
+ifeq ($(MR_BLEND_IMPL),neon)
+    LOCAL_CFLAGS += -DMR_BLEND_NEON
+else ifeq ($(MR_BLEND_IMPL),sse2)
+    LOCAL_CFLAGS += -DMR_BLEND_SSE2
+endif
+
 ifeq ($(MR_DPI),)
     $(info MR_DPI not defined in device files)
 else ifeq ($(MR_DPI),hdpi)
@@ -103,6 +121,12 @@ ifeq ($(MR_CONTINUOUS_FB_UPDATE),true)
     LOCAL_CFLAGS += -DMR_CONTINUOUS_FB_UPDATE
 endif
 
+# Draw into a separate buffer and copy it to the display on each frame even
+# when it's not rotated, for devices where reading display memory is slow
+ifeq ($(MR_DISABLE_FB_ZERO_COPY),true)
+    LOCAL_CFLAGS += -DMR_DISABLE_FB_ZERO_COPY
+endif
+
 LOCAL_CFLAGS += -DPLATFORM_SDK_VERSION=$(PLATFORM_SDK_VERSION)
 
 ifneq ($(BOARD_BOOTIMAGE_PARTITION_SIZE),)
@@ -120,3 +144,9 @@ endif
 ifneq ($(MR_RD_ADDR),)
     LOCAL_CFLAGS += -DMR_RD_ADDR=$(MR_RD_ADDR)
 endif
+
+# Compression level for the ramdisk when injecting trampoline, from 1
+# (fastest) to 9 (smallest). The compressor's default is used if unset.
+ifneq ($(MR_RD_COMPRESSION_LEVEL),)
+    LOCAL_CFLAGS += -DMR_RD_COMPRESSION_LEVEL=$(MR_RD_COMPRESSION_LEVEL)
+endif
@@ -30,34 +30,36 @@
 
 void kexec_init(struct kexec *k, const char *path)
 {
-    k->args = NULL;
+    memset(&k->args, 0, sizeof(k->args));
     kexec_add_arg(k, path);
 }
 
 void kexec_destroy(struct kexec *k)
 {
-    list_clear(&k->args, &free);
+    list_buf_clear(&k->args, &free);
 }
 
 int kexec_load_exec(struct kexec *k)
 {
-    int i, len;
+    char **args = (char**)k->args.items;
+    int i, len, status = -1;
+    char *out, *p;
 
     INFO("Loading kexec:\n");
-    for(i = 0; k->args && k->args[i]; ++i)
+    for(i = 0; args && args[i]; ++i)
     {
-        len = strlen(k->args[i]);
+        len = strlen(args[i]);
 
         if(len < 480)
-            INFO("    %s\n", k->args[i]);
+            INFO("    %s\n", args[i]);
         else
         {
             char buff[481];
             char *itr;
-            const char *end = k->args[i]+len;
+            const char *end = args[i]+len;
             int chunk = 0;
 
-            for(itr = k->args[i]; itr < end; itr += chunk)
+            for(itr = args[i]; itr < end; itr += chunk)
             {
                 chunk = imin(480, end - itr);
 
@@ -69,30 +71,34 @@ int kexec_load_exec(struct kexec *k)
         }
     }
 
-    if(run_cmd(k->args) == 0)
+    // Capture the output right away, so that failed load doesn't have
+    // to be re-run to find out what went wrong.
+    out = run_get_stdout_with_exit(args, &status);
+    if(status == 0)
+    {
+        free(out);
         return 0;
+    }
+
+    ERROR("kexec call failed (status %d), output:\n", status);
+    if(!out)
+        ERROR("  (no output)\n");
     else
     {
-        ERROR("kexec call failed, re-running it to get info:\n");
-        char *r = run_get_stdout(k->args);
-        if(!r)
-            ERROR("run_get_stdout returned NULL!\n");
-
-        char *p = strtok(r, "\n\r");
+        p = strtok(out, "\n\r");
         while(p)
         {
             ERROR("  %s\n", p);
             p = strtok(NULL, "\n\r");
         }
-        free(r);
-
-        return -1;
+        free(out);
     }
+    return -1;
 }
 
 void kexec_add_arg(struct kexec *k, const char *arg)
 {
-    list_add(&k->args, strdup(arg));
+    list_buf_add(&k->args, strdup(arg));
 }
 
 void kexec_add_arg_prefix(struct kexec *k, const char *prefix, const char *value)
@@ -101,7 +107,7 @@ void kexec_add_arg_prefix(struct kexec *k, const char *prefix, const char *value
     char *arg = malloc(len);
     snprintf(arg, len, "%s%s", prefix, value);
 
-    list_add(&k->args, arg);
+    list_buf_add(&k->args, arg);
 }
 
 void kexec_add_kernel(struct kexec *k, const char *path, int hardboot)
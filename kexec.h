@@ -18,9 +18,11 @@
 #ifndef KEXEC_H
 #define KEXEC_H
 
+#include "lib/containers.h"
+
 struct kexec
 {
-    char **args;
+    list_buf args; // NULL-terminated char* list in args.items
 };
 
 void kexec_init(struct kexec *k, const char *path);
@@ -5,10 +5,13 @@ common_SRC_FILES := \
     button.c \
     colors.c \
     containers.c \
+    cpio.c \
     framebuffer.c \
+    framebuffer_blend.c \
     framebuffer_generic.c \
     framebuffer_png.c \
     framebuffer_truetype.c \
+    fs_probe.c \
     fstab.c \
     inject.c \
     input.c \
@@ -17,6 +20,7 @@ common_SRC_FILES := \
     mrom_data.c \
     notification_card.c \
     progressdots.c \
+    ramdisk.c \
     tabview.c \
     touch_tracker.c \
     util.c \
@@ -31,7 +35,8 @@ common_C_INCLUDES := \
     system/extras/libbootimg/include \
 
 # With these, GCC optimizes aggressively enough so full-screen alpha blending
-# is quick enough to be done in an animation
+# is quick enough to be done in an animation even with the scalar kernels
+# from framebuffer_blend.c (see MR_BLEND_IMPL in device_defines.mk)
 common_C_FLAGS := -O3 -funsafe-math-optimizations
 
 ifeq ($(MR_INPUT_TYPE),)
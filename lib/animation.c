@@ -65,16 +65,17 @@ static void anim_list_append(struct anim_list_it *it)
 {
     pthread_mutex_lock(&anim_list.mutex);
     if(!anim_list.first)
-    {
         anim_list.first = anim_list.last = it;
-        pthread_mutex_unlock(&anim_list.mutex);
-        return;
+    else
+    {
+        it->prev = anim_list.last;
+        anim_list.last->next = it;
+        anim_list.last = it;
     }
-
-    it->prev = anim_list.last;
-    anim_list.last->next = it;
-    anim_list.last = it;
     pthread_mutex_unlock(&anim_list.mutex);
+
+    // anim_update goes idle when the list is empty
+    workers_wake();
 }
 
 // anim_list.mutex must be locked
@@ -154,6 +155,8 @@ static void item_anim_step(item_anim *anim, float interpolated, int *need_draw)
     anim_int_step(&fb_it->w, &anim->start[2], &anim->last[2], &anim->targetW, interpolated);
     anim_int_step(&fb_it->h, &anim->start[3], &anim->last[3], &anim->targetH, interpolated);
 
+    fb_damage_item(fb_it);
+
     if(!(*need_draw) && (!outside || item_anim_is_on_screen(anim)))
         *need_draw = 1;
 }
@@ -195,6 +198,7 @@ static int anim_update(uint32_t diff, void *data)
     anim_header *anim;
     float normalized, interpolated;
     int need_draw = 0;
+    int res;
 
     pthread_mutex_lock(&list->mutex);
     list->in_update_loop = 1;
@@ -274,9 +278,10 @@ static int anim_update(uint32_t diff, void *data)
         fb_request_draw();
 
     list->in_update_loop = 0;
+    res = list->first ? WORKER_CONTINUE : WORKER_IDLE;
     pthread_mutex_unlock(&list->mutex);
 
-    return 0;
+    return res;
 }
 
 static uint32_t anim_generate_id(void)
@@ -420,6 +425,7 @@ void anim_pop_context(void)
     }
     list_rm_at(&anim_list.inactive_ctx, idx, NULL);
     pthread_mutex_unlock(&anim_list.mutex);
+    workers_wake();
 }
 
 int anim_item_cancel_check(void *item_my, void *item_destroyed)
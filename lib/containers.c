@@ -16,9 +16,19 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#ifdef MR_CONTAINERS_BENCHMARK
+#include <stdio.h>
+#include <time.h>
+#endif
 
 #include "containers.h"
 #include "util.h"
+#ifdef MR_CONTAINERS_BENCHMARK
+#include "log.h"
+#endif
+
+#define INDEX_MIN_CAP 16
 
 int list_item_count(listItself list)
 {
@@ -127,7 +137,7 @@ int list_rm_opt(ptrToList list_p, void *item, callback destroy_callback_p, int r
             }
         }
 
-        *list= realloc(*list, size*sizeof(item));
+        // no need to shrink, the next list_add reallocs to the exact size anyway
         (*list)[size-1] = NULL;
         return 0;
     }
@@ -169,7 +179,6 @@ listItself list_rm_at(ptrToList list_p, int idx, callback destroy_callback_p)
     for(; i < size; ++i)
         (*list)[i] = (*list)[i+1];
 
-    *list = realloc(*list, size*sizeof(item));
     return *list + idx;
 }
 
@@ -237,12 +246,134 @@ void list_swap(ptrToList a_p, ptrToList b_p)
     *b = tmp;
 }
 
+static void list_buf_reserve(list_buf *b, int len)
+{
+    // +1 for the terminating NULL
+    if(len + 1 <= b->cap)
+        return;
+
+    b->cap = imax(8, b->cap*2);
+    while(b->cap < len + 1)
+        b->cap *= 2;
+    b->items = realloc(b->items, b->cap*sizeof(void*));
+}
+
+void list_buf_add(list_buf *b, void *item)
+{
+    list_buf_reserve(b, b->len + 1);
+    b->items[b->len++] = item;
+    b->items[b->len] = NULL;
+}
+
+int list_buf_add_from_list(list_buf *b, listItself src_p)
+{
+    void **src = (void**)src_p;
+    int len_src = list_item_count(src);
+
+    if(len_src == 0)
+        return 0;
+
+    list_buf_reserve(b, b->len + len_src);
+    memcpy(b->items + b->len, src, (len_src+1)*sizeof(void*));
+    b->len += len_src;
+    return len_src;
+}
+
+listItself list_buf_rm_at(list_buf *b, int idx, callback destroy_callback_p)
+{
+    callbackPtr destroy_callback = (callbackPtr)destroy_callback_p;
+
+    if(idx < 0 || idx >= b->len)
+        return NULL;
+
+    if(destroy_callback)
+        (*destroy_callback)(b->items[idx]);
+
+    // moves the terminating NULL too
+    memmove(b->items + idx, b->items + idx + 1, (b->len - idx)*sizeof(void*));
+    --b->len;
+    return b->items + idx;
+}
+
+void list_buf_clear(list_buf *b, callback destroy_callback_p)
+{
+    list_clear(&b->items, destroy_callback_p);
+    b->len = 0;
+    b->cap = 0;
+}
+
+listItself list_buf_detach(list_buf *b)
+{
+    void **res = b->items;
+    b->items = NULL;
+    b->len = 0;
+    b->cap = 0;
+    return res;
+}
+
+static uint32_t hash_str(const char *str)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for(; *str; ++str)
+        h = (h ^ (uint8_t)*str) * 16777619u;
+    return h;
+}
+
+static uint32_t hash_int(int key)
+{
+    // murmur3 finalizer, sizes and keycodes are tiny consecutive numbers
+    uint32_t h = key;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static void index_insert(int *index, size_t cap, uint32_t hash, int idx)
+{
+    size_t pos = hash & (cap - 1);
+    while(index[pos] != 0)
+        pos = (pos + 1) & (cap - 1);
+    index[pos] = idx + 1;
+}
+
+// Keeps the load factor at or below 1/2
+static size_t index_cap_for(size_t size)
+{
+    size_t cap = INDEX_MIN_CAP;
+    while(cap < size*2)
+        cap <<= 1;
+    return cap;
+}
+
+static void map_index_rebuild(map *m)
+{
+    size_t i;
+
+    m->index_cap = index_cap_for(m->size);
+    free(m->index);
+    m->index = calloc(m->index_cap, sizeof(int));
+
+    for(i = 0; i < m->size; ++i)
+        index_insert(m->index, m->index_cap, hash_str(m->keys[i]), i);
+}
+
 map *map_create(void)
 {
     map *m = mzalloc(sizeof(map));
     return m;
 }
 
+map *map_create_hashed(void)
+{
+    map *m = mzalloc(sizeof(map));
+    map_index_rebuild(m);
+    return m;
+}
+
 void map_destroy(map *m, void (*destroy_callback)(void*))
 {
     if(!m)
@@ -250,6 +381,7 @@ void map_destroy(map *m, void (*destroy_callback)(void*))
 
     list_clear(&m->keys, &free);
     list_clear(&m->values, destroy_callback);
+    free(m->index);
     free(m);
 }
 
@@ -271,6 +403,14 @@ void map_add_not_exist(map *m, const char *key, void *val)
     list_add(&m->keys, strdup(key));
     list_add(&m->values, val);
     ++m->size;
+
+    if(m->index)
+    {
+        if(m->size*2 > m->index_cap)
+            map_index_rebuild(m);
+        else
+            index_insert(m->index, m->index_cap, hash_str(key), m->size-1);
+    }
 }
 
 void map_rm(map *m, const char *key, void (*destroy_callback)(void*))
@@ -282,11 +422,25 @@ void map_rm(map *m, const char *key, void (*destroy_callback)(void*))
     list_rm_at(&m->keys, idx, &free);
     list_rm_at(&m->values, idx, destroy_callback);
     --m->size;
+
+    // items after idx have moved, so all slots have to be redone
+    if(m->index)
+        map_index_rebuild(m);
 }
 
 int map_find(map *m, const char *key)
 {
     int i;
+
+    if(m->index)
+    {
+        size_t pos = hash_str(key) & (m->index_cap - 1);
+        for(; m->index[pos] != 0; pos = (pos + 1) & (m->index_cap - 1))
+            if(strcmp(m->keys[m->index[pos]-1], key) == 0)
+                return m->index[pos]-1;
+        return -1;
+    }
+
     for(i = 0; m->keys && m->keys[i]; ++i)
         if(strcmp(m->keys[i], key) == 0)
             return i;
@@ -311,11 +465,30 @@ void *map_get_ref(map *m, const char *key)
 
 
 
+static void imap_index_rebuild(imap *m)
+{
+    size_t i;
+
+    m->index_cap = index_cap_for(m->size);
+    free(m->index);
+    m->index = calloc(m->index_cap, sizeof(int));
+
+    for(i = 0; i < m->size; ++i)
+        index_insert(m->index, m->index_cap, hash_int(m->keys[i]), i);
+}
+
 imap *imap_create(void)
 {
     return mzalloc(sizeof(imap));
 }
 
+imap *imap_create_hashed(void)
+{
+    imap *m = mzalloc(sizeof(imap));
+    imap_index_rebuild(m);
+    return m;
+}
+
 void imap_destroy(imap *m, void (*destroy_callback)(void*))
 {
     if(!m)
@@ -323,6 +496,7 @@ void imap_destroy(imap *m, void (*destroy_callback)(void*))
 
     list_clear(&m->values, destroy_callback);
     free(m->keys);
+    free(m->index);
     free(m);
 }
 
@@ -345,6 +519,14 @@ void imap_add_not_exist(imap *m, int key, void *val)
     m->keys[m->size++] = key;
 
     list_add(&m->values, val);
+
+    if(m->index)
+    {
+        if(m->size*2 > m->index_cap)
+            imap_index_rebuild(m);
+        else
+            index_insert(m->index, m->index_cap, hash_int(key), m->size-1);
+    }
 }
 
 void imap_rm(imap *m, int key, void (*destroy_callback)(void*))
@@ -360,11 +542,24 @@ void imap_rm(imap *m, int key, void (*destroy_callback)(void*))
     --m->size;
     m->keys = realloc(m->keys, sizeof(int)*m->size);
     list_rm_at(&m->values, idx, destroy_callback);
+
+    if(m->index)
+        imap_index_rebuild(m);
 }
 
 int imap_find(imap *m, int key)
 {
     size_t i;
+
+    if(m->index)
+    {
+        size_t pos = hash_int(key) & (m->index_cap - 1);
+        for(; m->index[pos] != 0; pos = (pos + 1) & (m->index_cap - 1))
+            if(m->keys[m->index[pos]-1] == key)
+                return m->index[pos]-1;
+        return -1;
+    }
+
     for(i = 0; i < m->size; ++i)
         if(key == m->keys[i])
             return i;
@@ -387,3 +582,79 @@ void *imap_get_ref(imap *m, int key)
     return &m->values[idx];
 }
 
+
+#ifdef MR_CONTAINERS_BENCHMARK
+static uint64_t bench_ns(struct timespec *start, struct timespec *end)
+{
+    return (uint64_t)(end->tv_sec - start->tv_sec)*1000000000ULL + end->tv_nsec - start->tv_nsec;
+}
+
+// Logs the average cost of a successful lookup in linear and hashed
+// maps of a few sizes.
+void containers_benchmark(void)
+{
+    static const int sizes[] = { 10, 100, 1000 };
+    static const int lookups = 100000;
+
+    struct timespec start, end;
+    char key[32];
+    char **keys;
+    map *m[2];
+    imap *im[2];
+    uint64_t ns[4];
+    size_t i_sz;
+    int i, x, n;
+    volatile int sink = 0;
+
+    for(i_sz = 0; i_sz < ARRAY_SIZE(sizes); ++i_sz)
+    {
+        n = sizes[i_sz];
+        keys = malloc(n*sizeof(char*));
+
+        m[0] = map_create();
+        m[1] = map_create_hashed();
+        im[0] = imap_create();
+        im[1] = imap_create_hashed();
+
+        for(i = 0; i < n; ++i)
+        {
+            // similar to the string cache keys, long common prefix
+            snprintf(key, sizeof(key), "Internal memory %d", i);
+            keys[i] = strdup(key);
+            for(x = 0; x < 2; ++x)
+            {
+                map_add_not_exist(m[x], key, NULL);
+                imap_add_not_exist(im[x], i, NULL);
+            }
+        }
+
+        for(x = 0; x < 2; ++x)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for(i = 0; i < lookups; ++i)
+                sink += map_find(m[x], keys[(i*7) % n]);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            ns[x] = bench_ns(&start, &end);
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for(i = 0; i < lookups; ++i)
+                sink += imap_find(im[x], (i*7) % n);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            ns[2+x] = bench_ns(&start, &end);
+        }
+
+        INFO("Lookup with %d entries: map %llu ns, hashed map %llu ns, imap %llu ns, hashed imap %llu ns\n", n,
+                (unsigned long long)ns[0]/lookups, (unsigned long long)ns[1]/lookups,
+                (unsigned long long)ns[2]/lookups, (unsigned long long)ns[3]/lookups);
+
+        for(x = 0; x < 2; ++x)
+        {
+            map_destroy(m[x], NULL);
+            imap_destroy(im[x], NULL);
+        }
+        for(i = 0; i < n; ++i)
+            free(keys[i]);
+        free(keys);
+    }
+}
+#endif
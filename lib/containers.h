@@ -38,14 +38,40 @@ int list_move(ptrToList dest_p, ptrToList source_p);
 void list_clear(ptrToList list_p, callback destroy_callback_p);
 void list_swap(ptrToList a_p, ptrToList b_p);
 
+// Pointer list which tracks its length and capacity, so that appending
+// is amortized O(1) instead of a walk and realloc per item. ->items is
+// always either NULL or NULL-terminated, so it can be passed to anything
+// that takes the plain lists above, but must not be resized by them.
+typedef struct
+{
+    void **items;
+    int len;
+    int cap;
+} list_buf;
+
+void list_buf_add(list_buf *b, void *item);
+int list_buf_add_from_list(list_buf *b, listItself src_p);
+listItself list_buf_rm_at(list_buf *b, int idx, callback destroy_callback_p); // returns pointer to the next item in list or NULL
+void list_buf_clear(list_buf *b, callback destroy_callback_p);
+listItself list_buf_detach(list_buf *b); // returns a plain list and resets b
+
+// Both maps keep keys and values in plain parallel arrays, so iterating
+// over them is the same for every instance. Maps created with the
+// *_create_hashed variants additionally keep an open-addressing index
+// of slots (item index + 1, 0 = empty) so that lookups don't have to
+// scan all the keys. The index is rebuilt on removal, so these are meant
+// for big, lookup-heavy maps.
 typedef struct
 {
     char **keys;
     void **values;
     size_t size;
+    int *index;
+    size_t index_cap;
 } map;
 
 map *map_create(void);
+map *map_create_hashed(void);
 void map_destroy(map *m, void (*destroy_callback)(void*));
 void map_add(map *m, const char *key, void *val, void (*destroy_callback)(void*));
 void map_add_not_exist(map *m, const char *key, void *val);
@@ -59,9 +85,12 @@ typedef struct
     int *keys;
     void **values;
     size_t size;
+    int *index;
+    size_t index_cap;
 } imap;
 
 imap *imap_create(void);
+imap *imap_create_hashed(void);
 void imap_destroy(imap *m, void (*destroy_callback)(void*));
 void imap_add(imap *m, int key, void *val, void (*destroy_callback)(void*));
 void imap_add_not_exist(imap *m, int key, void *val);
@@ -70,4 +99,8 @@ int imap_find(imap *m, int key);
 void *imap_get_val(imap *m, int key);
 void *imap_get_ref(imap *m, int key);
 
+#ifdef MR_CONTAINERS_BENCHMARK
+void containers_benchmark(void);
+#endif
+
 #endif
@@ -0,0 +1,394 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "cpio.h"
+#include "log.h"
+#include "util.h"
+
+#define CPIO_MAGIC "070701"
+#define CPIO_HDR_SIZE 110
+#define CPIO_TRAILER "TRAILER!!!"
+#define CPIO_ALIGN(x) (((x) + 3) & ~3)
+
+static const char *strip_name(const char *name)
+{
+    while(1)
+    {
+        if(name[0] == '.' && name[1] == '/')
+            name += 2;
+        else if(name[0] == '/')
+            ++name;
+        else
+            return name;
+    }
+}
+
+static int parse_hex(const uint8_t *str, uint32_t *res)
+{
+    int i;
+    uint32_t val = 0;
+    for(i = 0; i < 8; ++i)
+    {
+        val <<= 4;
+        if(str[i] >= '0' && str[i] <= '9')
+            val |= str[i] - '0';
+        else if(str[i] >= 'a' && str[i] <= 'f')
+            val |= str[i] - 'a' + 10;
+        else if(str[i] >= 'A' && str[i] <= 'F')
+            val |= str[i] - 'A' + 10;
+        else
+            return -1;
+    }
+    *res = val;
+    return 0;
+}
+
+static void cpio_entry_destroy(struct cpio_entry *e)
+{
+    if(e->data_owned)
+        free((void*)e->data);
+    free(e->name);
+    free(e);
+}
+
+static void cpio_entry_set_data(struct cpio_entry *e, uint8_t *data, uint32_t size)
+{
+    if(e->data_owned)
+        free((void*)e->data);
+    e->data = data;
+    e->size = size;
+    e->data_owned = 1;
+}
+
+struct cpio_archive *cpio_parse(const uint8_t *data, size_t size)
+{
+    struct cpio_archive *a = mzalloc(sizeof(struct cpio_archive));
+    struct cpio_entry *e;
+    uint32_t fields[13];
+    size_t pos = 0;
+    int i;
+
+    while(1)
+    {
+        if(pos + CPIO_HDR_SIZE > size || memcmp(data + pos, CPIO_MAGIC, 6) != 0)
+        {
+            ERROR("cpio: bad header at offset %zu\n", pos);
+            goto fail;
+        }
+
+        // ino, mode, uid, gid, nlink, mtime, filesize, devmajor, devminor,
+        // rdevmajor, rdevminor, namesize, check
+        for(i = 0; i < 13; ++i)
+        {
+            if(parse_hex(data + pos + 6 + i*8, &fields[i]) < 0)
+            {
+                ERROR("cpio: bad header at offset %zu\n", pos);
+                goto fail;
+            }
+        }
+
+        const uint32_t namesize = fields[11];
+        const uint32_t filesize = fields[6];
+        const char *name = (const char*)data + pos + CPIO_HDR_SIZE;
+
+        if(namesize == 0 || pos + CPIO_HDR_SIZE + namesize > size || name[namesize-1] != 0)
+        {
+            ERROR("cpio: bad name at offset %zu\n", pos);
+            goto fail;
+        }
+
+        pos = CPIO_ALIGN(pos + CPIO_HDR_SIZE + namesize);
+        if(strcmp(name, CPIO_TRAILER) == 0)
+            break;
+
+        if(pos + filesize > size)
+        {
+            ERROR("cpio: %s is truncated\n", name);
+            goto fail;
+        }
+
+        e = mzalloc(sizeof(struct cpio_entry));
+        e->name = strdup(name);
+        e->ino = fields[0];
+        e->mode = fields[1];
+        e->uid = fields[2];
+        e->gid = fields[3];
+        e->nlink = fields[4];
+        e->mtime = fields[5];
+        e->devmajor = fields[7];
+        e->devminor = fields[8];
+        e->rdevmajor = fields[9];
+        e->rdevminor = fields[10];
+        e->data = data + pos;
+        e->size = filesize;
+        list_buf_add(&a->entries, e);
+
+        if(e->ino >= a->next_ino)
+            a->next_ino = e->ino + 1;
+
+        pos = CPIO_ALIGN(pos + filesize);
+    }
+
+    return a;
+
+fail:
+    cpio_destroy(a);
+    return NULL;
+}
+
+void cpio_destroy(struct cpio_archive *a)
+{
+    if(!a)
+        return;
+    list_buf_clear(&a->entries, &cpio_entry_destroy);
+    free(a);
+}
+
+static uint8_t *cpio_write_entry(uint8_t *out, const struct cpio_entry *e, const char *name)
+{
+    const uint32_t namesize = strlen(name) + 1;
+    uint8_t *start = out;
+
+    out += sprintf((char*)out, CPIO_MAGIC "%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+            e->ino, e->mode, e->uid, e->gid, e->nlink, e->mtime, e->size,
+            e->devmajor, e->devminor, e->rdevmajor, e->rdevminor, namesize, 0);
+    memcpy(out, name, namesize);
+    out += namesize;
+    while((out - start) & 3)
+        *out++ = 0;
+
+    if(e->size)
+    {
+        memcpy(out, e->data, e->size);
+        out += e->size;
+        while((out - start) & 3)
+            *out++ = 0;
+    }
+    return out;
+}
+
+uint8_t *cpio_write(struct cpio_archive *a, size_t *size)
+{
+    static const struct cpio_entry trailer = { .nlink = 1 };
+    struct cpio_entry *e;
+    size_t len = 0;
+    uint8_t *res, *out;
+    int i;
+
+    for(i = 0; i < a->entries.len; ++i)
+    {
+        e = a->entries.items[i];
+        len += CPIO_ALIGN(CPIO_HDR_SIZE + strlen(e->name) + 1) + CPIO_ALIGN(e->size);
+    }
+    len += CPIO_ALIGN(CPIO_HDR_SIZE + sizeof(CPIO_TRAILER));
+
+    // +1 for the NUL sprintf() writes after the last header
+    res = malloc(len + 1);
+    if(!res)
+        return NULL;
+
+    out = res;
+    for(i = 0; i < a->entries.len; ++i)
+    {
+        e = a->entries.items[i];
+        out = cpio_write_entry(out, e, e->name);
+    }
+    out = cpio_write_entry(out, &trailer, CPIO_TRAILER);
+
+    *size = out - res;
+    return res;
+}
+
+static int cpio_find_idx(struct cpio_archive *a, const char *name)
+{
+    struct cpio_entry *e;
+    int i;
+
+    name = strip_name(name);
+    for(i = 0; i < a->entries.len; ++i)
+    {
+        e = a->entries.items[i];
+        if(strcmp(strip_name(e->name), name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+struct cpio_entry *cpio_find(struct cpio_archive *a, const char *name)
+{
+    int idx = cpio_find_idx(a, name);
+    return idx >= 0 ? a->entries.items[idx] : NULL;
+}
+
+void cpio_rm(struct cpio_archive *a, const char *name)
+{
+    struct cpio_entry *e;
+    const char *e_name;
+    size_t len;
+    int i;
+
+    name = strip_name(name);
+    len = strlen(name);
+
+    for(i = 0; i < a->entries.len;)
+    {
+        e = a->entries.items[i];
+        e_name = strip_name(e->name);
+        if(strncmp(e_name, name, len) == 0 && (e_name[len] == 0 || e_name[len] == '/'))
+            list_buf_rm_at(&a->entries, i, &cpio_entry_destroy);
+        else
+            ++i;
+    }
+}
+
+int cpio_rename(struct cpio_archive *a, const char *from, const char *to)
+{
+    struct cpio_entry *e = cpio_find(a, from);
+    if(!e)
+        return -1;
+
+    cpio_rm(a, to);
+    free(e->name);
+    e->name = strdup(strip_name(to));
+    return 0;
+}
+
+static struct cpio_entry *cpio_get_or_add(struct cpio_archive *a, const char *name, uint32_t mode)
+{
+    struct cpio_entry *e = cpio_find(a, name);
+    if(e)
+    {
+        // keep the type and permissions of the replaced entry if none were specified
+        if((mode & S_IFMT) == 0)
+            mode |= e->mode & S_IFMT;
+        if((mode & 07777) == 0)
+            mode |= e->mode & 07777;
+        e->mode = mode;
+        e->nlink = S_ISDIR(mode) ? 2 : 1;
+        return e;
+    }
+
+    e = mzalloc(sizeof(struct cpio_entry));
+    e->name = strdup(strip_name(name));
+    e->ino = a->next_ino++;
+    e->mode = mode;
+    e->nlink = S_ISDIR(mode) ? 2 : 1;
+    list_buf_add(&a->entries, e);
+    return e;
+}
+
+struct cpio_entry *cpio_set_data(struct cpio_archive *a, const char *name, uint32_t mode, uint8_t *data, uint32_t size)
+{
+    struct cpio_entry *e = cpio_get_or_add(a, name, mode);
+    cpio_entry_set_data(e, data, size);
+    return e;
+}
+
+struct cpio_entry *cpio_set_symlink(struct cpio_archive *a, const char *name, const char *target)
+{
+    cpio_rm(a, name);
+    return cpio_set_data(a, name, S_IFLNK | 0777, (uint8_t*)strdup(target), strlen(target));
+}
+
+struct cpio_entry *cpio_set_file(struct cpio_archive *a, const char *name, const char *path, uint32_t mode)
+{
+    size_t size;
+    uint8_t *data = read_whole_file(path, &size);
+    if(!data)
+        return NULL;
+
+    struct cpio_entry *e = cpio_set_data(a, name, S_IFREG | (mode & 07777), data, size);
+    if((e->mode & 07777) == 0)
+        e->mode |= 0644;
+    return e;
+}
+
+int cpio_add_tree(struct cpio_archive *a, const char *name, const char *path)
+{
+    struct stat info;
+    struct dirent *dr;
+    struct cpio_entry *e;
+    char buf[PATH_MAX];
+    char *sub_name, *sub_path;
+    int res = 0;
+    DIR *d;
+
+    if(lstat(path, &info) < 0)
+        return -1;
+
+    if(S_ISLNK(info.st_mode))
+    {
+        ssize_t len = readlink(path, buf, sizeof(buf)-1);
+        if(len < 0)
+            return -1;
+        buf[len] = 0;
+        e = cpio_set_symlink(a, name, buf);
+    }
+    else if(S_ISREG(info.st_mode))
+        e = cpio_set_file(a, name, path, info.st_mode);
+    else if(S_ISDIR(info.st_mode))
+        e = cpio_set_data(a, name, info.st_mode, NULL, 0);
+    else
+        return 0;
+
+    if(!e)
+        return -1;
+
+    e->uid = info.st_uid;
+    e->gid = info.st_gid;
+    e->mtime = info.st_mtime;
+
+    if(!S_ISDIR(info.st_mode))
+        return 0;
+
+    d = opendir(path);
+    if(!d)
+        return -1;
+
+    while(res == 0 && (dr = readdir(d)))
+    {
+        if(strcmp(dr->d_name, ".") == 0 || strcmp(dr->d_name, "..") == 0)
+            continue;
+
+        if(asprintf(&sub_name, "%s/%s", name, dr->d_name) < 0)
+        {
+            res = -1;
+            break;
+        }
+        if(asprintf(&sub_path, "%s/%s", path, dr->d_name) < 0)
+        {
+            free(sub_name);
+            res = -1;
+            break;
+        }
+
+        res = cpio_add_tree(a, sub_name, sub_path);
+
+        free(sub_name);
+        free(sub_path);
+    }
+    closedir(d);
+    return res;
+}
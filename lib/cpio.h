@@ -0,0 +1,72 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CPIO_H
+#define CPIO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "containers.h"
+
+// In-memory "newc" cpio archive, as used by the kernel's initramfs.
+// Entries parsed from a buffer point into it, so it has to outlive
+// the archive. Names are compared without leading "./" or "/".
+struct cpio_entry
+{
+    char *name;
+    uint32_t ino;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t nlink;
+    uint32_t mtime;
+    uint32_t devmajor;
+    uint32_t devminor;
+    uint32_t rdevmajor;
+    uint32_t rdevminor;
+
+    const uint8_t *data;
+    uint32_t size;
+    int data_owned;
+};
+
+struct cpio_archive
+{
+    list_buf entries; // struct cpio_entry*, in archive order
+    uint32_t next_ino;
+};
+
+struct cpio_archive *cpio_parse(const uint8_t *data, size_t size);
+void cpio_destroy(struct cpio_archive *a);
+// returns malloc'ed buffer with the archive, trailer included
+uint8_t *cpio_write(struct cpio_archive *a, size_t *size);
+
+struct cpio_entry *cpio_find(struct cpio_archive *a, const char *name);
+// removes name and, if it is a directory, everything inside it
+void cpio_rm(struct cpio_archive *a, const char *name);
+int cpio_rename(struct cpio_archive *a, const char *from, const char *to);
+
+// These replace the entry if it already exists. data is taken over by
+// the archive.
+struct cpio_entry *cpio_set_data(struct cpio_archive *a, const char *name, uint32_t mode, uint8_t *data, uint32_t size);
+struct cpio_entry *cpio_set_symlink(struct cpio_archive *a, const char *name, const char *target);
+struct cpio_entry *cpio_set_file(struct cpio_archive *a, const char *name, const char *path, uint32_t mode);
+// Copies a directory tree from disk, like cp -a
+int cpio_add_tree(struct cpio_archive *a, const char *name, const char *path);
+
+#endif
@@ -15,7 +15,9 @@
  */
 
 #include <drm_fourcc.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -49,9 +51,12 @@ typedef struct drm_surface {
     uint32_t handle;
 }drm_surface;
 
+// How long to wait for a page flip before giving up on it
+#define DRM_FLIP_TIMEOUT_MS 100
+
 static drm_surface *drm_surfaces[2];
 static int current_buffer;
-static GRSurface *draw_buf = NULL;
+static int flip_pending;
 
 static drmModeCrtc *main_monitor_crtc;
 static drmModeConnector *main_monitor_connector;
@@ -457,25 +462,19 @@ static int drm_init(struct framebuffer *fb) {
         return -1;
     }
 
-    draw_buf = (GRSurface *)malloc(sizeof(GRSurface));
-    if (!draw_buf) {
-        INFO("failed to alloc draw_buf\n");
-        drm_destroy_surface(drm_surfaces[0]);
-        drm_destroy_surface(drm_surfaces[1]);
-        drmModeFreeResources(res);
-        close(drm_fd);
-        return -1;
-    }
-
-    memcpy(draw_buf, &drm_surfaces[0]->base, sizeof(GRSurface));
+    /*
+     * The framebuffer code draws directly into the dumb surfaces returned
+     * by drm_get_frame_dest(), both have the same layout.
+     */
+    const GRSurface *surface = &drm_surfaces[0]->base;
 
     /*Assign framebuffer properties here to maintain compatibility*/
 
-    fb_width = draw_buf->width;
-    fb_height = draw_buf->height;
-    fb->stride = draw_buf->row_bytes / draw_buf->pixel_bytes;
-    fb->size = draw_buf->height * draw_buf->row_bytes * draw_buf->pixel_bytes;
-    fb->vi.bits_per_pixel = draw_buf->pixel_bytes * 8;
+    fb_width = surface->width;
+    fb_height = surface->height;
+    fb->stride = surface->row_bytes / surface->pixel_bytes;
+    fb->size = surface->height * surface->row_bytes;
+    fb->vi.bits_per_pixel = surface->pixel_bytes * 8;
     fb->vi.xres = fb_width;
     fb->vi.yres = fb_height;
     fb->vi.xres_virtual = fb_width;
@@ -539,51 +538,87 @@ static int drm_init(struct framebuffer *fb) {
 #error "Unknown pixel format"
 #endif
 
-
-    draw_buf->data = (unsigned char *)calloc(draw_buf->height * draw_buf->row_bytes, 1);
-    if (!draw_buf->data) {
-        INFO("failed to alloc draw_buf surface\n");
-        free(draw_buf);
-        drm_destroy_surface(drm_surfaces[0]);
-        drm_destroy_surface(drm_surfaces[1]);
-        drmModeFreeResources(res);
-        close(drm_fd);
-        return -1;
-    }
-
     drm_enable_crtc(drm_fd, main_monitor_crtc, drm_surfaces[1]);
 
     current_buffer = 0;
+    flip_pending = 0;
 
     return 0;
 }
 
-static int drm_update(struct framebuffer *fb) {
+static void drm_page_flip_handler(UNUSED int fd, UNUSED unsigned int sequence,
+                                  UNUSED unsigned int tv_sec, UNUSED unsigned int tv_usec,
+                                  UNUSED void *user_data) {
+    flip_pending = 0;
+}
+
+/*
+ * The buffer replaced by a page flip is scanned out until the flip
+ * completes, so it must not be drawn into before that. Waits for the
+ * event requested by drm_update(), returns 1 if a flip was pending.
+ */
+static int drm_wait_flip(UNUSED struct framebuffer *fb) {
+    drmEventContext evctx;
+    struct pollfd pfd;
     int ret;
 
-    memcpy(drm_surfaces[current_buffer]->base.data,
-            draw_buf->data, draw_buf->height * draw_buf->row_bytes);
+    if (!flip_pending)
+        return 0;
+
+    memset(&evctx, 0, sizeof(evctx));
+    evctx.version = 2;
+    evctx.page_flip_handler = drm_page_flip_handler;
 
+    pfd.fd = drm_fd;
+    pfd.events = POLLIN;
+
+    while (flip_pending) {
+        ret = poll(&pfd, 1, DRM_FLIP_TIMEOUT_MS);
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret <= 0) {
+            ERROR("Waiting for page flip failed: %s\n", ret == 0 ? "timeout" : strerror(errno));
+            flip_pending = 0;
+            return -1;
+        }
+
+        if (drmHandleEvent(drm_fd, &evctx) != 0) {
+            ERROR("drmHandleEvent failed\n");
+            flip_pending = 0;
+            return -1;
+        }
+    }
+
+    return 1;
+}
+
+static int drm_update(struct framebuffer *fb) {
+    int ret;
+
+    drm_wait_flip(fb);
 
     ret = drmModePageFlip(drm_fd, main_monitor_crtc->crtc_id,
-            drm_surfaces[current_buffer]->fb_id, 0, NULL);
+            drm_surfaces[current_buffer]->fb_id, DRM_MODE_PAGE_FLIP_EVENT, NULL);
 
     if (ret < 0) {
         ERROR("drmModePageFlip failed ret=%d\n", ret);
         return -1;
     }
 
+    flip_pending = 1;
     current_buffer = 1 - current_buffer;
 
     return 0;
 }
 
 static void* drm_get_frame_dest(struct framebuffer *fb) {
-
-    return draw_buf->data;
+    drm_wait_flip(fb);
+    return drm_surfaces[current_buffer]->base.data;
 }
 
 static void drm_exit(struct framebuffer *fb) {
+    drm_wait_flip(fb);
     drm_disable_crtc(drm_fd, main_monitor_crtc);
     drm_destroy_surface(drm_surfaces[0]);
     drm_destroy_surface(drm_surfaces[1]);
@@ -600,4 +635,5 @@ const struct fb_impl fb_impl_drm = {
     .close = drm_exit,
     .update = drm_update,
     .get_frame_dest = drm_get_frame_dest,
+    .wait_vsync = drm_wait_flip,
 };
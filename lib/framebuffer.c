@@ -33,6 +33,7 @@
 #include <pthread.h>
 #include <png.h>
 #include <math.h>
+#include <limits.h>
 
 #include "log.h"
 #include "framebuffer.h"
@@ -49,6 +50,17 @@
 #define fb_memset(dst, what, len) android_memset16(dst, what, len)
 #endif
 
+#define FB_DAMAGE_MAX_RECTS 8
+// How many previously pushed frames might be missing from the buffer
+// returned by get_frame_dest() - qcom overlay uses three buffers.
+#define FB_DAMAGE_HISTORY 2
+
+struct fb_damage {
+    fb_item_pos rects[FB_DAMAGE_MAX_RECTS];
+    int cnt;
+    int full;
+};
+
 
 uint32_t fb_width = 0;
 uint32_t fb_height = 0;
@@ -70,21 +82,37 @@ static fb_context_t fb_ctx = {
     .mutex = PTHREAD_MUTEX_INITIALIZER
 };
 
+static struct fb_damage fb_damage = {
+    .cnt = 0,
+    .full = 1,
+};
+static pthread_mutex_t fb_damage_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int fb_damage_rows[FB_DAMAGE_HISTORY][2];
+static const fb_item_pos *fb_clip = &DEFAULT_FB_PARENT;
+// fb.buffer points to the last pushed frame dest instead of a separate
+// buffer, see fb_frame_begin()
+static int fb_zero_copy = 0;
+
 static fb_context_t **inactive_ctx = NULL;
-static uint8_t **fb_rot_helpers = NULL;
 static pthread_t fb_draw_thread;
 static pthread_mutex_t fb_update_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t fb_draw_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t fb_draw_cond = PTHREAD_COND_INITIALIZER;
 static atomic_int fb_draw_requested = ATOMIC_VAR_INIT(0);
+// fb_request_seq is bumped on each new draw request, so that
+// the idle draw thread can sleep until one comes
+static pthread_mutex_t fb_request_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fb_request_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int fb_request_seq = 0;
 static volatile int fb_draw_run = 0;
 static void *fb_draw_thread_work(void*);
+static void fb_request_signal(void);
 
 static void fb_destroy_item(void *item); // private!
-static void fb_cpy_fb_with_rotation(px_type *dst, px_type *src);
-static void fb_rotate_90deg(px_type *dst, px_type *src);
-static void fb_rotate_270deg(px_type *dst, px_type *src);
-static void fb_rotate_180deg(px_type *dst, px_type *src);
+static void fb_cpy_fb_with_rotation(px_type *dst, px_type *src, int y, int h);
+static void fb_rotate_90deg(px_type *dst, int dst_stride, const px_type *src, int src_stride, int w, int src_h, int y, int h);
+static void fb_rotate_270deg(px_type *dst, int dst_stride, const px_type *src, int src_stride, int w, int src_h, int y, int h);
+static void fb_rotate_180deg(px_type *dst, int dst_stride, const px_type *src, int src_stride, int w, int src_h, int y, int h);
 
 int fb_open_impl(void)
 {
@@ -125,6 +153,8 @@ int fb_open_impl(void)
 
 int fb_open(int rotation)
 {
+    int i;
+
     memset(&fb, 0, sizeof(struct framebuffer));
 
 #ifndef MR_DEVICE_HAS_DRM_GRAPHICS
@@ -184,12 +214,30 @@ int fb_open(int rotation)
         goto fail;
 #endif
 
-    fb.buffer = malloc(fb.size);
+#ifndef MR_DISABLE_FB_ZERO_COPY
+    // Without rotation, frame dests have the same layout as fb.buffer
+    fb_zero_copy = (fb_rotation == 0);
+#endif
+
+    if(fb_zero_copy)
+        fb.buffer = fb.impl->get_frame_dest(&fb);
+    else
+        fb.buffer = malloc(fb.size);
     fb_memset(fb.buffer, fb_convert_color(BLACK), fb.size);
 
+    // none of the frame dests has valid content yet
+    for(i = 0; i < FB_DAMAGE_HISTORY; ++i)
+    {
+        fb_damage_rows[i][0] = 0;
+        fb_damage_rows[i][1] = fb_height;
+    }
+
 #if 0
     fb_dump_info();
 #endif
+#ifdef MR_FB_ROTATION_BENCHMARK
+    fb_rotation_benchmark();
+#endif
 
     DEFAULT_FB_PARENT.w = fb_width;
     DEFAULT_FB_PARENT.h = fb_height;
@@ -210,16 +258,15 @@ fail:
 void fb_close(void)
 {
     fb_draw_run = 0;
+    fb_request_signal();
     pthread_join(fb_draw_thread, NULL);
 
-    free(fb_rot_helpers);
-    fb_rot_helpers = NULL;
-
     fb.impl->close(&fb);
     fb.impl = NULL;
 
     close(fb.fd);
-    free(fb.buffer);
+    if(!fb_zero_copy)
+        free(fb.buffer);
     fb.buffer = NULL;
 }
 
@@ -286,90 +333,250 @@ void fb_force_generic_impl(int force)
     fb_force_generic = force;
 }
 
-void fb_update(void)
+// Extends [*y, *y2) by the rows which were pushed in previous frames,
+// because the buffer we're about to write to does not have them.
+static void fb_damage_rows_history(int *y, int *y2)
+{
+    int i;
+    for(i = 0; i < FB_DAMAGE_HISTORY; ++i)
+    {
+        if(fb_damage_rows[i][1] <= fb_damage_rows[i][0])
+            continue;
+        *y = imin(*y, fb_damage_rows[i][0]);
+        *y2 = imax(*y2, fb_damage_rows[i][1]);
+    }
+}
+
+/*
+ * Drawing a frame is wrapped in fb_frame_begin() and fb_frame_end(), both
+ * called with fb_update_mutex locked. In zero-copy mode, fb_frame_begin()
+ * switches fb.buffer to the next frame dest, and brings it up to date from
+ * the previous one, so the damaged areas can be drawn into it directly.
+ * Rows [y, y+h) were changed in fb.buffer outside of the compositor.
+ */
+static void fb_frame_begin(int y, int h)
 {
-    fb_cpy_fb_with_rotation(fb.impl->get_frame_dest(&fb), fb.buffer);
+    px_type *dst;
+    int y2 = y + h;
+
+    if(!fb_zero_copy)
+        return;
+
+    if(h <= 0)
+    {
+        y = INT_MAX;
+        y2 = INT_MIN;
+    }
+
+    dst = fb.impl->get_frame_dest(&fb);
+    if(dst != fb.buffer)
+    {
+        fb_damage_rows_history(&y, &y2);
+        if(y2 > y)
+            memcpy(dst + fb.stride*y, fb.buffer + fb.stride*y, fb.stride*(y2 - y)*PIXEL_SIZE);
+        fb.buffer = dst;
+    }
+}
+
+// y and h are in rotated coordinates, rows [y, y+h) of fb.buffer
+// were changed since the last frame.
+static void fb_frame_end(int y, int h)
+{
+    int i;
+    int y1 = y, y2 = y + h;
+
+    if(!fb_zero_copy)
+    {
+        fb_damage_rows_history(&y1, &y2);
+        fb_cpy_fb_with_rotation(fb.impl->get_frame_dest(&fb), fb.buffer, y1, y2 - y1);
+    }
+
+    for(i = FB_DAMAGE_HISTORY-1; i > 0; --i)
+    {
+        fb_damage_rows[i][0] = fb_damage_rows[i-1][0];
+        fb_damage_rows[i][1] = fb_damage_rows[i-1][1];
+    }
+    fb_damage_rows[0][0] = y;
+    fb_damage_rows[0][1] = y + h;
+
     fb.impl->update(&fb);
 }
 
-void fb_cpy_fb_with_rotation(px_type *dst, px_type *src)
+// y and h are in rotated coordinates, fb_update_mutex must be locked
+static void fb_update_rows(int y, int h)
+{
+    fb_frame_begin(y, h);
+    fb_frame_end(y, h);
+}
+
+void fb_update(void)
+{
+    fb_update_rows(0, fb_height);
+}
+
+void fb_cpy_fb_with_rotation(px_type *dst, px_type *src, int y, int h)
 {
     switch(fb_rotation)
     {
         case 0:
-            memcpy(dst, src, fb.vi.xres_virtual * fb.vi.yres * PIXEL_SIZE);
+            memcpy(dst + fb.stride*y, src + fb.stride*y, fb.stride * h * PIXEL_SIZE);
             break;
         case 90:
-            fb_rotate_90deg(dst, src);
+            fb_rotate_90deg(dst, fb.vi.xres_virtual, src, fb.stride, fb_width, fb_height, y, h);
             break;
         case 180:
-            fb_rotate_180deg(dst, src);
+            fb_rotate_180deg(dst, fb.vi.xres_virtual, src, fb.stride, fb_width, fb_height, y, h);
             break;
         case 270:
-            fb_rotate_270deg(dst, src);
+            fb_rotate_270deg(dst, fb.vi.xres_virtual, src, fb.stride, fb_width, fb_height, y, h);
             break;
     }
 }
 
-void fb_rotate_90deg(px_type *dst, px_type *src)
-{
-    uint32_t i;
-    int32_t x;
+/*
+ * The rotation functions copy rows [y, y+h) of the w x src_h image in src
+ * to their rotated position in dst. Strides are in pixels, so the padding
+ * of the virtual resolution is left untouched.
+ *
+ * 90 and 270 degree rotations are done in FB_ROT_TILE x FB_ROT_TILE tiles.
+ * Reading src column by column through the whole image misses the cache on
+ * every pixel, while the rows of one tile stay cached until it is done.
+ */
+#define FB_ROT_TILE 16
 
-    if(!fb_rot_helpers)
-        fb_rot_helpers = malloc(fb_height*sizeof(px_type*));
+// Copies columns [tx, tx+tw) of th src rows into consecutive pixels of dst
+// rows. src points to the first row to read, src_step moves to the next one
+// and dst_step moves from the dst row of one src column to the next.
+static inline void fb_rotate_tile(px_type *dst, const px_type *src, int src_step,
+        int tx, int tw, int th, int dst_step)
+{
+    int x, i;
+    const px_type *s;
 
-    px_type **helpers = (px_type**)fb_rot_helpers;
+    for(x = 0; x < tw; ++x)
+    {
+        s = src + tx + x;
+        for(i = 0; i < th; ++i)
+        {
+            dst[i] = *s;
+            s += src_step;
+        }
+        dst += dst_step;
+    }
+}
 
-    helpers[0] = src;
-    for(i = 1; i < fb_height; ++i)
-        helpers[i] = helpers[i-1] + fb.stride;
+void fb_rotate_90deg(px_type *dst, int dst_stride, const px_type *src, int src_stride, int w, int src_h, int y, int h)
+{
+    int ty, tx, th;
+    const int y2 = y + h;
 
-    const int padding = fb.vi.xres_virtual - fb.vi.xres;
-    for(i = 0; i < fb_width; ++i)
+    // src[r][x] goes to dst[x][src_h - 1 - r], so walk the tile's rows
+    // from the bottom one to write dst rows left to right
+    for(ty = y; ty < y2; ty += FB_ROT_TILE)
     {
-        for(x = fb_height-1; x >= 0; --x)
-            *dst++ = *(helpers[x]++);
-        dst += padding;
+        th = imin(FB_ROT_TILE, y2 - ty);
+        const px_type *s = src + (ty + th - 1)*src_stride;
+        for(tx = 0; tx < w; tx += FB_ROT_TILE)
+        {
+            fb_rotate_tile(dst + tx*dst_stride + (src_h - ty - th), s, -src_stride, tx, imin(FB_ROT_TILE, w - tx), th, dst_stride);
+        }
     }
 }
 
-void fb_rotate_270deg(px_type *dst, px_type *src)
+void fb_rotate_270deg(px_type *dst, int dst_stride, const px_type *src, int src_stride, int w, int src_h, int y, int h)
 {
-    if(!fb_rot_helpers)
-        fb_rot_helpers = malloc(fb_height*sizeof(px_type*));
+    int ty, tx, th;
+    const int y2 = y + h;
+
+    // src[r][x] goes to dst[w - 1 - x][r]
+    for(ty = y; ty < y2; ty += FB_ROT_TILE)
+    {
+        th = imin(FB_ROT_TILE, y2 - ty);
+        const px_type *s = src + ty*src_stride;
+        for(tx = 0; tx < w; tx += FB_ROT_TILE)
+        {
+            fb_rotate_tile(dst + (w - 1 - tx)*dst_stride + ty, s, src_stride, tx, imin(FB_ROT_TILE, w - tx), th, -dst_stride);
+        }
+    }
+}
 
-    uint32_t i, x;
-    px_type **helpers = (px_type**)fb_rot_helpers;
+void fb_rotate_180deg(px_type *dst, int dst_stride, const px_type *src, int src_stride, int w, int src_h, int y, int h)
+{
+    int i, x;
+    const px_type *s;
 
-    helpers[0] = src + fb_width-1;
-    for(i = 1; i < fb_height; ++i)
-        helpers[i] = helpers[i-1] + fb.stride;
+    // src[r][x] goes to dst[src_h - 1 - r][w - 1 - x]
+    dst += dst_stride*(src_h - 1 - y);
+    src += src_stride*y + w;
 
-    const int padding = fb.vi.xres_virtual - fb.vi.xres;
-    for(i = 0; i < fb_width; ++i)
+    for(i = 0; i < h; ++i)
     {
-        for(x = 0; x < fb_height; ++x)
-            *dst++ = *(helpers[x]--);
-        dst += padding;
+        s = src;
+        for(x = 0; x < w; ++x)
+            dst[x] = *(--s);
+        dst -= dst_stride;
+        src += src_stride;
     }
 }
 
-void fb_rotate_180deg(px_type *dst, px_type *src)
+#ifdef MR_FB_ROTATION_BENCHMARK
+// Logs the throughput of the rotation functions on a few common
+// portrait panels, turned to landscape by the rotation.
+void fb_rotation_benchmark(void)
 {
-    uint32_t i, x;
-    int len = fb.vi.xres_virtual * fb.vi.yres;
-    src += len;
-
-    const int padding = fb.vi.xres_virtual - fb.vi.xres;
-    for(i = 0; i < fb_height; ++i)
+    static const int panels[][2] = {
+        { 480, 800 }, { 720, 1280 }, { 1080, 1920 }, { 1440, 2560 },
+    };
+    static const int iterations = 30;
+
+    struct timespec start, end;
+    px_type *src, *dst;
+    uint32_t ms[3];
+    int i, itr;
+    size_t i_pn;
+
+    for(i_pn = 0; i_pn < ARRAY_SIZE(panels); ++i_pn)
     {
-        src -= padding;
-        for(x = 0; x < fb_width; ++x)
-            *dst++ = *(--src);
-        dst += padding;
+        const int xres = panels[i_pn][0];
+        const int yres = panels[i_pn][1];
+        const size_t size = xres*yres*PIXEL_SIZE;
+
+        src = malloc(size);
+        dst = malloc(size);
+        memset(src, 0x55, size);
+
+        for(i = 0; i < 3; ++i)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for(itr = 0; itr < iterations; ++itr)
+            {
+                switch(i)
+                {
+                    case 0:
+                        fb_rotate_90deg(dst, xres, src, yres, yres, xres, 0, xres);
+                        break;
+                    case 1:
+                        fb_rotate_180deg(dst, xres, src, xres, xres, yres, 0, yres);
+                        break;
+                    case 2:
+                        fb_rotate_270deg(dst, xres, src, yres, yres, xres, 0, xres);
+                        break;
+                }
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            ms[i] = imax(1, timespec_diff(&start, &end));
+        }
+
+        INFO("Rotation of %dx%d: 90deg %llu MB/s, 180deg %llu MB/s, 270deg %llu MB/s\n", xres, yres,
+                (unsigned long long)size*iterations*1000/ms[0]/(1024*1024),
+                (unsigned long long)size*iterations*1000/ms[1]/(1024*1024),
+                (unsigned long long)size*iterations*1000/ms[2]/(1024*1024));
+
+        free(src);
+        free(dst);
     }
 }
+#endif
 
 int fb_clone(char **buff)
 {
@@ -386,6 +593,26 @@ int fb_clone(char **buff)
 void fb_fill(uint32_t color)
 {
     fb_memset(fb.buffer, fb_convert_color(color), fb.size);
+    fb_damage_all();
+}
+
+static void fb_fill_rect(uint32_t color, const fb_item_pos *r)
+{
+    int i;
+    const px_type px = fb_convert_color(color);
+    px_type *bits = fb.buffer + fb.stride*r->y + r->x;
+
+    if(r->x == 0 && r->w == (int)fb_width)
+    {
+        fb_memset(bits, px, fb.stride*r->h*PIXEL_SIZE);
+        return;
+    }
+
+    for(i = 0; i < r->h; ++i)
+    {
+        fb_memset(bits, px, r->w*PIXEL_SIZE);
+        bits += fb.stride;
+    }
 }
 
 px_type fb_convert_color(uint32_t c)
@@ -422,6 +649,7 @@ uint32_t fb_convert_color_img(uint32_t clr)
 void fb_set_background(uint32_t color)
 {
     fb_ctx.background_color = color;
+    fb_damage_all();
 }
 
 void fb_batch_start(void)
@@ -504,6 +732,8 @@ void fb_ctx_add_item(void *item)
     }
 
     fb_items_unlock();
+
+    fb_damage_item(h);
 }
 
 void fb_ctx_rm_item(void *item)
@@ -521,6 +751,8 @@ void fb_ctx_rm_item(void *item)
         h->next->prev = h->prev;
 
     fb_items_unlock();
+
+    fb_damage_rect(h->drawn_pos.x, h->drawn_pos.y, h->drawn_pos.w, h->drawn_pos.h);
 }
 
 void fb_remove_item(void *item)
@@ -576,7 +808,7 @@ void fb_destroy_item(void *item)
     free(item);
 }
 
-static void clamp_to_parent(void *it, int *min_x, int *max_x, int *min_y, int *max_y)
+static void clamp_to_parent(void *it, const fb_item_pos *clip, int *min_x, int *max_x, int *min_y, int *max_y)
 {
     fb_item_header *h = it;
 
@@ -601,6 +833,16 @@ static void clamp_to_parent(void *it, int *min_x, int *max_x, int *min_y, int *m
         parent_h = imin(parent_y + parent_h, fb_height) - parent_y;
     }
 
+    if(clip != &DEFAULT_FB_PARENT)
+    {
+        const int clip_x2 = imin(parent_x + parent_w, clip->x + clip->w);
+        const int clip_y2 = imin(parent_y + parent_h, clip->y + clip->h);
+        parent_x = imax(parent_x, clip->x);
+        parent_y = imax(parent_y, clip->y);
+        parent_w = clip_x2 - parent_x;
+        parent_h = clip_y2 - parent_y;
+    }
+
     *min_x = h->x >= parent_x ? 0 : parent_x - h->x;
     *min_y = h->y >= parent_y ? 0 : parent_y - h->y;
     *max_x = imin(h->w, parent_x + parent_w - h->x);
@@ -610,26 +852,13 @@ static void clamp_to_parent(void *it, int *min_x, int *max_x, int *min_y, int *m
 void fb_draw_rect(fb_rect *r)
 {
     const uint8_t alpha = (r->color >> 24) & 0xFF;
-    const uint8_t inv_alpha = 0xFF - ((r->color >> 24) & 0xFF);
     const px_type color = fb_convert_color(r->color);
 
     if(alpha == 0)
         return;
 
-#if defined(RECOVERY_RGBX) || (RECOVERY_RGBA) || defined(RECOVERY_ABGR) || defined(RECOVERY_BGRA)
-    const uint32_t premult_color_rb = ((color & 0xFF00FF) * (alpha)) >> 8;
-    const uint32_t premult_color_g = ((color & 0x00FF00) * (alpha)) >> 8;
-#elif defined(RECOVERY_RGB_565)
-    const uint8_t alpha5b = (alpha >> 3) + 1;
-    const uint8_t alpha6b = (alpha >> 2) + 1;
-    const uint8_t inv_alpha5b = 32 - alpha5b;
-    const uint8_t inv_alpha6b = 64 - alpha6b;
-    const uint16_t premult_color_rb = ((color & 0xF81F) * alpha5b) >> 5;
-    const uint16_t premult_color_g = ((color & 0x7E0) * alpha6b) >> 6;
-#endif
-
     int min_x, max_x, min_y, max_y;
-    clamp_to_parent(r, &min_x, &max_x, &min_y, &max_y);
+    clamp_to_parent(r, fb_clip, &min_x, &max_x, &min_y, &max_y);
     const int rendered_w = max_x - min_x;
 
     if(rendered_w <= 0)
@@ -639,64 +868,25 @@ void fb_draw_rect(fb_rect *r)
 
     px_type *bits = fb.buffer + (fb.stride*(r->y + min_y)) + r->x + min_x;
 
-    int i, x;
-    uint8_t *comps_bits;
-    const uint8_t *comps_clr = (uint8_t*)&color;
+    int i;
     for(i = min_y; i < max_y; ++i)
     {
-        if(alpha == 0xFF)
-        {
-            fb_memset(bits, color, w);
-            bits += fb.stride;
-        }
-        // Do the blending
+#ifndef MR_DISABLE_ALPHA
+        if(alpha != 0xFF)
+            fb_blend_color_row(bits, rendered_w, color, alpha);
         else
-        {
-#ifdef MR_DISABLE_ALPHA
+#endif
             fb_memset(bits, color, w);
-            bits += fb.stride;
-#else
-            for(x = 0; x < rendered_w; ++x)
-            {
-  #if defined(RECOVERY_RGBX) || defined(RECOVERY_RGBA) || defined(RECOVERY_ABGR) || defined(RECOVERY_BGRA)
-                const uint32_t rb = (premult_color_rb & 0xFF00FF) + ((inv_alpha * (*bits & 0xFF00FF)) >> 8);
-                const uint32_t g = (premult_color_g & 0x00FF00) + ((inv_alpha * (*bits & 0x00FF00)) >> 8);
-                *bits = 0xFF000000 | (rb & 0xFF00FF) | (g & 0x00FF00);
-  #elif defined(RECOVERY_RGB_565)
-                const uint16_t rb = (premult_color_rb & 0xF81F) + ((inv_alpha5b * (*bits & 0xF81F)) >> 5);
-                const uint16_t g = (premult_color_g & 0x7E0) + ((inv_alpha6b * (*bits & 0x7E0)) >> 6);
-                *bits = (rb & 0xF81F) | (g & 0x7E0);
-  #else
-    #error "No alpha blending implementation for this format!"
-  #endif
-                ++bits;
-            }
-            bits += fb.stride - rendered_w;
-#endif // MR_DISABLE_ALPHA
-        }
+        bits += fb.stride;
     }
 }
 
-static int blend_png(int value1, int value2, int alpha) {
-    int r = (0xFF-alpha)*value1 + alpha*value2;
-    return (r+1 + (r >> 8)) >> 8; // divide by 255
-}
-
 void fb_draw_img(fb_img *i)
 {
-    int y, x;
-    const int w = i->w*PIXEL_SIZE;
-    uint8_t alpha;
-    uint8_t *comps_img, *comps_bits;
-
-#if PIXEL_SIZE == 4
-    const uint8_t max_alpha = 0xFF;
-#elif PIXEL_SIZE == 2
-    const uint8_t max_alpha = 31;
-#endif
+    int y;
 
     int min_x, max_x, min_y, max_y;
-    clamp_to_parent(i, &min_x, &max_x, &min_y, &max_y);
+    clamp_to_parent(i, fb_clip, &min_x, &max_x, &min_y, &max_y);
     const int rendered_w = max_x - min_x;
 
     if(rendered_w <= 0)
@@ -707,54 +897,35 @@ void fb_draw_img(fb_img *i)
 
     for(y = min_y; y < max_y; ++y)
     {
-        for(x = min_x; x < max_x; ++x)
-        {
-            // Colors, 0xAABBGGRR
-#if PIXEL_SIZE == 4
-            alpha = PX_GET_A(*img);
-#elif PIXEL_SIZE == 2
-            alpha = ((uint8_t*)img)[2];
-#endif
-            // fully opaque
-            if(alpha == max_alpha)
-            {
-                *bits = *img;
-            }
-            // do the blending
-            else if(alpha != 0x00)
-            {
 #ifdef MR_DISABLE_ALPHA
-                *bits = *img;
-#else
+        int x;
+        px_type *itr = img;
+        for(x = 0; x < rendered_w; ++x)
+        {
   #if PIXEL_SIZE == 4
-                comps_bits = (uint8_t*)bits;
-                comps_img = (uint8_t*)img;
-                comps_bits[PX_IDX_R] = blend_png(comps_bits[PX_IDX_R], comps_img[PX_IDX_R], comps_img[PX_IDX_A]);
-                comps_bits[PX_IDX_G] = blend_png(comps_bits[PX_IDX_G], comps_img[PX_IDX_G], comps_img[PX_IDX_A]);
-                comps_bits[PX_IDX_B] = blend_png(comps_bits[PX_IDX_B], comps_img[PX_IDX_B], comps_img[PX_IDX_A]);
-                comps_bits[PX_IDX_A] = 0xFF;
-  #else
-                const uint8_t alpha5b = alpha;
-                const uint8_t alpha6b = ((uint8_t*)img)[3];
-                *bits = (((31-alpha5b)*(*bits & 0x1F)            + (alpha5b*(*img & 0x1F))) / 31) |
-                        ((((63-alpha6b)*((*bits & 0x7E0) >> 5)   + (alpha6b*((*img & 0x7E0) >> 5))) / 63) << 5) |
-                        ((((31-alpha5b)*((*bits & 0xF800) >> 11) + (alpha5b*((*img & 0xF800) >> 11))) / 31) << 11);
-  #endif // PIXEL_SIZE
-#endif // MR_DISABLE_ALPHA
-            }
-
-            ++bits;
-#if PIXEL_SIZE == 4
-            ++img;
-#elif PIXEL_SIZE == 2
-            img += 2;
-#endif
+            if(PX_GET_A(*itr) != 0x00)
+                bits[x] = *itr;
+            ++itr;
+  #elif PIXEL_SIZE == 2
+            if(((uint8_t*)itr)[2] != 0x00)
+                bits[x] = *itr;
+            itr += 2;
+  #endif
         }
-        bits += fb.stride - rendered_w;
-        img = (px_type*)(((uint32_t*)img) + (i->w - rendered_w));
+#else
+        fb_blend_img_row(bits, img, rendered_w);
+#endif
+        bits += fb.stride;
+        img = (px_type*)(((uint32_t*)img) + i->w);
     }
 }
 
+static inline int fb_in_clip(int x, int y)
+{
+    return x >= fb_clip->x && y >= fb_clip->y &&
+            x < fb_clip->x + fb_clip->w && y < fb_clip->y + fb_clip->h;
+}
+
 // from http://members.chello.at/~easyfilter/bresenham.html
 void fb_draw_line(fb_line *l)
 {
@@ -790,7 +961,8 @@ void fb_draw_line(fb_line *l)
             for(e2 = dy-err-th; e2+dy < 255; e2 += dy)
             {
                 x1 += sx;
-                *(fb.buffer + fb.stride*y0 + x1) = px;
+                if(fb_in_clip(x1, y0))
+                    *(fb.buffer + fb.stride*y0 + x1) = px;
             }
             if(y0 == y1)
                 break;
@@ -812,7 +984,8 @@ void fb_draw_line(fb_line *l)
             for(e2 = dx - err - th; e2+dx < 255; e2 += dx)
             {
                 y1 += sy;
-                *(fb.buffer + fb.stride*y1 + x0) = px;
+                if(fb_in_clip(x0, y1))
+                    *(fb.buffer + fb.stride*y1 + x0) = px;
             }
 
             if(x0 == x1)
@@ -996,20 +1169,208 @@ void fb_clear(void)
     fb_ctx.first_item = NULL;
     pthread_mutex_unlock(&fb_ctx.mutex);
 
+    fb_damage_all();
+
     fb_png_drop_unused();
     fb_text_drop_cache_unused();
 }
 
-static void fb_draw(void)
+static int fb_rect_intersect(fb_item_pos *res, const fb_item_pos *a, const fb_item_pos *b)
+{
+    const int x2 = imin(a->x + a->w, b->x + b->w);
+    const int y2 = imin(a->y + a->h, b->y + b->h);
+
+    res->x = imax(a->x, b->x);
+    res->y = imax(a->y, b->y);
+    res->w = x2 - res->x;
+    res->h = y2 - res->y;
+    return res->w > 0 && res->h > 0;
+}
+
+static void fb_rect_unite(fb_item_pos *dst, const fb_item_pos *src)
+{
+    const int x2 = imax(dst->x + dst->w, src->x + src->w);
+    const int y2 = imax(dst->y + dst->h, src->y + src->h);
+
+    dst->x = imin(dst->x, src->x);
+    dst->y = imin(dst->y, src->y);
+    dst->w = x2 - dst->x;
+    dst->h = y2 - dst->y;
+}
+
+// touching rects count too, so that neighbouring rows get merged
+static int fb_rect_touches(const fb_item_pos *a, const fb_item_pos *b)
+{
+    return a->x <= b->x + b->w && b->x <= a->x + a->w &&
+            a->y <= b->y + b->h && b->y <= a->y + a->h;
+}
+
+// returns area occupied by the item on screen, 0 if it isn't visible
+static int fb_item_bounds(fb_item_header *it, fb_item_pos *res)
+{
+    int min_x, max_x, min_y, max_y;
+
+    memset(res, 0, sizeof(fb_item_pos));
+
+    switch(it->type)
+    {
+        case FB_IT_RECT:
+        case FB_IT_IMG:
+            clamp_to_parent(it, &DEFAULT_FB_PARENT, &min_x, &max_x, &min_y, &max_y);
+            if(max_x <= min_x || max_y <= min_y)
+                return 0;
+            res->x = it->x + min_x;
+            res->y = it->y + min_y;
+            res->w = max_x - min_x;
+            res->h = max_y - min_y;
+            break;
+        case FB_IT_LINE:
+        {
+            fb_line *l = (fb_line*)it;
+            const int x0 = imin(imax(l->x, l->parent->x), l->parent->x + l->parent->w);
+            const int x1 = imin(imax(l->x2, l->parent->x), l->parent->x + l->parent->w);
+            const int y0 = imin(imax(l->y, l->parent->y), l->parent->y + l->parent->h);
+            const int y1 = imin(imax(l->y2, l->parent->y), l->parent->y + l->parent->h);
+            if(x0 == x1 && y0 == y1)
+                return 0;
+            res->x = imin(x0, x1) - l->thickness;
+            res->y = imin(y0, y1) - l->thickness;
+            res->w = iabs(x1 - x0) + l->thickness*2 + 1;
+            res->h = iabs(y1 - y0) + l->thickness*2 + 1;
+            break;
+        }
+        default:
+            return 0;
+    }
+    return 1;
+}
+
+static uintptr_t fb_item_key(fb_item_header *it)
+{
+    switch(it->type)
+    {
+        case FB_IT_RECT:
+            return ((fb_rect*)it)->color;
+        case FB_IT_LINE:
+            return ((fb_line*)it)->color;
+        case FB_IT_IMG:
+            return (uintptr_t)((fb_img*)it)->data;
+        default:
+            return 0;
+    }
+}
+
+// fb_damage_mutex must be locked
+static void fb_damage_add_locked(const fb_item_pos *r)
+{
+    int i;
+    fb_item_pos c;
+
+    if(fb_damage.full || !fb_rect_intersect(&c, r, &DEFAULT_FB_PARENT))
+        return;
+
+    for(i = 0; i < fb_damage.cnt; )
+    {
+        if(fb_rect_touches(&c, &fb_damage.rects[i]))
+        {
+            // the merged rect might touch some of the previous ones now
+            fb_rect_unite(&c, &fb_damage.rects[i]);
+            fb_damage.rects[i] = fb_damage.rects[--fb_damage.cnt];
+            i = 0;
+        }
+        else
+            ++i;
+    }
+
+    if(fb_damage.cnt == FB_DAMAGE_MAX_RECTS)
+    {
+        for(i = 0; i < fb_damage.cnt; ++i)
+            fb_rect_unite(&c, &fb_damage.rects[i]);
+        fb_damage.cnt = 0;
+    }
+
+    // not worth the bookkeeping
+    if(c.w*c.h >= (int)(fb_width*fb_height)/4*3)
+    {
+        fb_damage.full = 1;
+        fb_damage.cnt = 0;
+        return;
+    }
+
+    fb_damage.rects[fb_damage.cnt++] = c;
+}
+
+void fb_damage_rect(int x, int y, int w, int h)
+{
+    fb_item_pos r = { .x = x, .y = y, .w = w, .h = h };
+
+    pthread_mutex_lock(&fb_damage_mutex);
+    fb_damage_add_locked(&r);
+    pthread_mutex_unlock(&fb_damage_mutex);
+}
+
+// damages both the area where the item was drawn and where it is now
+void fb_damage_item(void *item)
+{
+    fb_item_header *h = item;
+    fb_item_pos r;
+
+    pthread_mutex_lock(&fb_damage_mutex);
+    fb_damage_add_locked(&h->drawn_pos);
+    if(fb_item_bounds(h, &r))
+        fb_damage_add_locked(&r);
+    pthread_mutex_unlock(&fb_damage_mutex);
+}
+
+void fb_damage_all(void)
+{
+    pthread_mutex_lock(&fb_damage_mutex);
+    fb_damage.full = 1;
+    fb_damage.cnt = 0;
+    pthread_mutex_unlock(&fb_damage_mutex);
+}
+
+// Items are often moved or recolored directly, so every item is compared
+// with the state it was last drawn in. fb_ctx.mutex must be locked.
+static void fb_damage_collect(void)
 {
-    uint32_t i;
     fb_item_header *it;
+    fb_item_pos cur;
+    uintptr_t key;
 
-    fb_fill(fb_ctx.background_color);
+    pthread_mutex_lock(&fb_damage_mutex);
+    for(it = fb_ctx.first_item; it; it = it->next)
+    {
+        if(it->type == FB_IT_LISTVIEW)
+            continue;
 
-    fb_batch_start();
+        fb_item_bounds(it, &cur);
+        key = fb_item_key(it);
+
+        if(key == it->drawn_key && memcmp(&cur, &it->drawn_pos, sizeof(fb_item_pos)) == 0)
+            continue;
+
+        fb_damage_add_locked(&it->drawn_pos);
+        fb_damage_add_locked(&cur);
+        it->drawn_pos = cur;
+        it->drawn_key = key;
+    }
+    pthread_mutex_unlock(&fb_damage_mutex);
+}
+
+static void fb_draw_region(const fb_item_pos *r)
+{
+    fb_item_header *it;
+    fb_item_pos tmp;
+
+    fb_fill_rect(fb_ctx.background_color, r);
+
+    fb_clip = r;
     for(it = fb_ctx.first_item; it; it = it->next)
     {
+        if(!fb_rect_intersect(&tmp, &it->drawn_pos, r))
+            continue;
+
         switch(it->type)
         {
             case FB_IT_RECT:
@@ -1018,19 +1379,67 @@ static void fb_draw(void)
             case FB_IT_IMG:
                 fb_draw_img((fb_img*)it);
                 break;
-            case FB_IT_LISTVIEW:
-                listview_update_ui_args((listview*)it, 1, 1);
-                break;
             case FB_IT_LINE:
                 fb_draw_line((fb_line*)it);
                 break;
         }
     }
-    fb_batch_end();
+    fb_clip = &DEFAULT_FB_PARENT;
+}
+
+// returns 1 if a frame was pushed to the display
+static int fb_draw(void)
+{
+    int i, y, y2;
+    fb_item_header *it;
+    struct fb_damage damage;
+
+    fb_batch_start();
+
+    // listviews only move their items around, that has to happen
+    // before the damage is known
+    for(it = fb_ctx.first_item; it; it = it->next)
+    {
+        if(it->type == FB_IT_LISTVIEW)
+            listview_update_ui_args((listview*)it, 1, 1);
+    }
+
+    fb_damage_collect();
+
+    pthread_mutex_lock(&fb_damage_mutex);
+    damage = fb_damage;
+    fb_damage.full = 0;
+    fb_damage.cnt = 0;
+    pthread_mutex_unlock(&fb_damage_mutex);
+
+    if(damage.full)
+    {
+        damage.rects[0] = DEFAULT_FB_PARENT;
+        damage.cnt = 1;
+    }
+
+    if(damage.cnt == 0)
+    {
+        fb_batch_end();
+        return 0;
+    }
+
+    y = INT_MAX;
+    y2 = INT_MIN;
+    for(i = 0; i < damage.cnt; ++i)
+    {
+        y = imin(y, damage.rects[i].y);
+        y2 = imax(y2, damage.rects[i].y + damage.rects[i].h);
+    }
 
     pthread_mutex_lock(&fb_update_mutex);
-    fb_update();
+    fb_frame_begin(0, 0);
+    for(i = 0; i < damage.cnt; ++i)
+        fb_draw_region(&damage.rects[i]);
+    fb_batch_end();
+    fb_frame_end(y, y2 - y);
     pthread_mutex_unlock(&fb_update_mutex);
+    return 1;
 }
 
 void fb_freeze(int freeze)
@@ -1061,6 +1470,8 @@ void fb_push_context(void)
     pthread_mutex_unlock(&fb_ctx.mutex);
 
     list_add(&inactive_ctx, ctx);
+
+    fb_damage_all();
 }
 
 void fb_pop_context(void)
@@ -1080,28 +1491,54 @@ void fb_pop_context(void)
 
     list_rm_noreorder(&inactive_ctx, ctx, &free);
 
+    fb_damage_all();
+
     fb_request_draw();
 }
 
+static void fb_request_signal(void)
+{
+    pthread_mutex_lock(&fb_request_mutex);
+    ++fb_request_seq;
+    pthread_cond_signal(&fb_request_cond);
+    pthread_mutex_unlock(&fb_request_mutex);
+}
+
+// Sleeps until a draw is requested after fb_request_seq had the value
+// seen. Everything that sets fb_draw_requested or stops the thread calls
+// fb_request_signal(), so there is no need to poll.
+static void fb_wait_for_request(unsigned int seen)
+{
+    pthread_mutex_lock(&fb_request_mutex);
+    while(fb_draw_run && fb_request_seq == seen)
+        pthread_cond_wait(&fb_request_cond, &fb_request_mutex);
+    pthread_mutex_unlock(&fb_request_mutex);
+}
+
 #define SLEEP_CONST 16
 void *fb_draw_thread_work(UNUSED void *cookie)
 {
-    struct timespec last, curr;
-    uint32_t diff = 0, prevSleepTime = 0;
-    clock_gettime(CLOCK_MONOTONIC, &last);
+    struct timespec start, now;
+    uint32_t diff;
+    unsigned int seen;
+    int pushed, res;
 
     atomic_int expected = ATOMIC_VAR_INIT(1);
 
     while(fb_draw_run)
     {
-        clock_gettime(CLOCK_MONOTONIC, &curr);
-        diff = timespec_diff(&last, &curr);
+        clock_gettime(CLOCK_MONOTONIC, &start);
 
+        pthread_mutex_lock(&fb_request_mutex);
+        seen = fb_request_seq;
+        pthread_mutex_unlock(&fb_request_mutex);
+
+        pushed = 0;
         expected = 1; // might be reseted by atomic_compare_exchange_strong
         pthread_mutex_lock(&fb_draw_mutex);
         if(atomic_compare_exchange_strong(&fb_draw_requested, &expected, 0))
         {
-            fb_draw();
+            pushed = fb_draw();
             pthread_cond_broadcast(&fb_draw_cond);
             pthread_mutex_unlock(&fb_draw_mutex);
         }
@@ -1112,18 +1549,33 @@ void *fb_draw_thread_work(UNUSED void *cookie)
             pthread_mutex_lock(&fb_update_mutex);
             fb_update();
             pthread_mutex_unlock(&fb_update_mutex);
+            pushed = 1;
 #endif
         }
 
+        if(!pushed)
+        {
+            fb_wait_for_request(seen);
+            continue;
+        }
 
-        last = curr;
-        if(diff <= SLEEP_CONST+prevSleepTime)
+        // Draw the next frame once this one is on screen if the impl
+        // can tell, otherwise limit the frame rate by sleeping
+        if(fb.impl->wait_vsync)
         {
-            prevSleepTime = SLEEP_CONST+prevSleepTime-diff;
-            usleep(prevSleepTime*1000);
+            pthread_mutex_lock(&fb_update_mutex);
+            res = fb.impl->wait_vsync(&fb);
+            pthread_mutex_unlock(&fb_update_mutex);
+            // 0 means no flip was queued (e.g. it failed), so nothing
+            // paced this frame and the sleep below has to
+            if(res > 0)
+                continue;
         }
-        else
-            prevSleepTime = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        diff = timespec_diff(&start, &now);
+        if(diff < SLEEP_CONST)
+            usleep((SLEEP_CONST - diff)*1000);
     }
     return NULL;
 }
@@ -1133,7 +1585,8 @@ void fb_request_draw(void)
     if(!fb_frozen)
     {
         atomic_int expected = ATOMIC_VAR_INIT(0);
-        atomic_compare_exchange_strong(&fb_draw_requested, &expected, 1);
+        if(atomic_compare_exchange_strong(&fb_draw_requested, &expected, 1))
+            fb_request_signal();
     }
 }
 
@@ -1143,6 +1596,7 @@ void fb_force_draw(void)
 
     pthread_mutex_lock(&fb_draw_mutex);
     atomic_compare_exchange_strong(&fb_draw_requested, &expected, 1);
+    fb_request_signal();
     pthread_cond_wait(&fb_draw_cond, &fb_draw_mutex);
     pthread_mutex_unlock(&fb_draw_mutex);
 }
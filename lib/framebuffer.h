@@ -96,6 +96,10 @@ struct fb_impl {
     void (*close)(struct framebuffer *fb);
     int (*update)(struct framebuffer *fb);
     void *(*get_frame_dest)(struct framebuffer *fb);
+    // Optional, used to pace the draw thread to the display. Blocks until
+    // the frame pushed by the last update() is on screen, returns 1 if it
+    // waited, 0 if there was nothing to wait for and -1 on error.
+    int (*wait_vsync)(struct framebuffer *fb);
 };
 
 enum
@@ -139,6 +143,9 @@ int fb_open_impl(void);
 void fb_close(void);
 void fb_update(void);
 void fb_dump_info(void);
+#ifdef MR_FB_ROTATION_BENCHMARK
+void fb_rotation_benchmark(void);
+#endif
 int fb_get_vi_xres(void);
 int fb_get_vi_yres(void);
 void fb_force_generic_impl(int force);
@@ -201,6 +208,8 @@ typedef struct
 
 extern fb_item_pos DEFAULT_FB_PARENT;
 
+// drawn_pos and drawn_key belong to the compositor, they hold the area
+// and content of the item as it was last drawn (see fb_damage_collect())
 #define FB_ITEM_HEAD \
     FB_ITEM_POS \
     int id; \
@@ -208,7 +217,9 @@ extern fb_item_pos DEFAULT_FB_PARENT;
     int level; \
     fb_item_pos *parent; \
     struct fb_item_header *prev; \
-    struct fb_item_header *next;
+    struct fb_item_header *next; \
+    fb_item_pos drawn_pos; \
+    uintptr_t drawn_key;
 
 struct fb_item_header
 {
@@ -319,6 +330,15 @@ void fb_draw_rect(fb_rect *r);
 void fb_draw_img(fb_img *i);
 void fb_draw_line(fb_line *l);
 void fb_fill(uint32_t color);
+
+// framebuffer_blend.c, blends one row of len pixels into dst.
+// img uses the fb_img data layout, 4 bytes per pixel even in RGB_565.
+void fb_blend_color_row(px_type *dst, int len, px_type color, uint8_t alpha);
+void fb_blend_img_row(px_type *dst, const px_type *img, int len);
+
+void fb_damage_rect(int x, int y, int w, int h);
+void fb_damage_item(void *item);
+void fb_damage_all(void);
 void fb_request_draw(void);
 void fb_force_draw(void);
 void fb_clear(void);
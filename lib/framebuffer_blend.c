@@ -0,0 +1,355 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "framebuffer.h"
+
+/*
+ * Alpha blending kernels used by fb_draw_rect() and fb_draw_img().
+ * MR_BLEND_NEON or MR_BLEND_SSE2 is set from device_defines.mk, and is only
+ * used if the compiler actually targets that instruction set. The vector
+ * paths produce exactly the same pixels as the scalar ones, which still
+ * handle the leftover pixels at the end of each row.
+ */
+#if defined(MR_BLEND_NEON) && defined(__ARM_NEON)
+  #include <arm_neon.h>
+  #define BLEND_NEON
+#elif defined(MR_BLEND_SSE2) && defined(__SSE2__)
+  #include <emmintrin.h>
+  #define BLEND_SSE2
+#endif
+
+#if PIXEL_SIZE == 4
+
+// (x + 1 + (x >> 8)) >> 8 == x/255 for x <= 255*255
+static inline uint8_t blend_png(int value1, int value2, int alpha)
+{
+    int r = (0xFF-alpha)*value1 + alpha*value2;
+    return (r+1 + (r >> 8)) >> 8; // divide by 255
+}
+
+void fb_blend_color_row(px_type *dst, int len, px_type color, uint8_t alpha)
+{
+    const uint8_t inv_alpha = 0xFF - alpha;
+    const uint32_t premult_color_rb = ((color & 0xFF00FF) * (alpha)) >> 8;
+    const uint32_t premult_color_g = ((color & 0x00FF00) * (alpha)) >> 8;
+    int x = 0;
+
+#if defined(BLEND_NEON)
+    const uint8x16_t premult = vreinterpretq_u8_u32(vdupq_n_u32(
+            (premult_color_rb & 0xFF00FF) | (premult_color_g & 0x00FF00)));
+    const uint8x8_t inv = vdup_n_u8(inv_alpha);
+    const uint32x4_t opaque = vdupq_n_u32(0xFF000000);
+
+    for(; x + 4 <= len; x += 4, dst += 4)
+    {
+        const uint8x16_t d = vreinterpretq_u8_u32(vld1q_u32(dst));
+        const uint8x8_t lo = vshrn_n_u16(vmull_u8(vget_low_u8(d), inv), 8);
+        const uint8x8_t hi = vshrn_n_u16(vmull_u8(vget_high_u8(d), inv), 8);
+        const uint8x16_t res = vaddq_u8(vcombine_u8(lo, hi), premult);
+        vst1q_u32(dst, vorrq_u32(vreinterpretq_u32_u8(res), opaque));
+    }
+#elif defined(BLEND_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i premult = _mm_set1_epi32(
+            (premult_color_rb & 0xFF00FF) | (premult_color_g & 0x00FF00));
+    const __m128i inv = _mm_set1_epi16(inv_alpha);
+    const __m128i opaque = _mm_set1_epi32(0xFF000000);
+
+    for(; x + 4 <= len; x += 4, dst += 4)
+    {
+        const __m128i d = _mm_loadu_si128((__m128i*)dst);
+        __m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), inv), 8);
+        __m128i hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), inv), 8);
+        __m128i res = _mm_add_epi8(_mm_packus_epi16(lo, hi), premult);
+        _mm_storeu_si128((__m128i*)dst, _mm_or_si128(res, opaque));
+    }
+#endif
+
+    for(; x < len; ++x, ++dst)
+    {
+        const uint32_t rb = (premult_color_rb & 0xFF00FF) + ((inv_alpha * (*dst & 0xFF00FF)) >> 8);
+        const uint32_t g = (premult_color_g & 0x00FF00) + ((inv_alpha * (*dst & 0x00FF00)) >> 8);
+        *dst = 0xFF000000 | (rb & 0xFF00FF) | (g & 0x00FF00);
+    }
+}
+
+void fb_blend_img_row(px_type *dst, const px_type *img, int len)
+{
+    int x = 0;
+    uint8_t alpha;
+    uint8_t *comps_bits;
+    const uint8_t *comps_img;
+
+#if defined(BLEND_NEON)
+    const uint16x8_t one = vdupq_n_u16(1);
+    const uint8x8_t opaque = vdup_n_u8(0xFF);
+    int c;
+
+    for(; x + 8 <= len; x += 8, dst += 8, img += 8)
+    {
+        const uint8x8x4_t s = vld4_u8((const uint8_t*)img);
+        const uint64_t a_bits = vget_lane_u64(vreinterpret_u64_u8(s.val[PX_IDX_A]), 0);
+
+        if(a_bits == 0)
+            continue;
+
+        if(a_bits == UINT64_MAX)
+        {
+            vst4_u8((uint8_t*)dst, s);
+            continue;
+        }
+
+        const uint8x8x4_t d = vld4_u8((uint8_t*)dst);
+        const uint8x8_t a = s.val[PX_IDX_A];
+        const uint8x8_t inv = vmvn_u8(a);
+        const uint8x8_t transparent = vceq_u8(a, vdup_n_u8(0));
+        uint8x8x4_t res;
+
+        for(c = 0; c < 4; ++c)
+        {
+            if(c == PX_IDX_A)
+            {
+                res.val[c] = vbsl_u8(transparent, d.val[c], opaque);
+                continue;
+            }
+
+            uint16x8_t r = vmlal_u8(vmull_u8(d.val[c], inv), s.val[c], a);
+            r = vaddq_u16(vaddq_u16(r, one), vshrq_n_u16(r, 8));
+            res.val[c] = vbsl_u8(transparent, d.val[c], vshrn_n_u16(r, 8));
+        }
+        vst4_u8((uint8_t*)dst, res);
+    }
+#elif defined(BLEND_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i max = _mm_set1_epi16(0xFF);
+    const __m128i opaque = _mm_set1_epi32(0xFF000000);
+
+    for(; x + 4 <= len; x += 4, dst += 4, img += 4)
+    {
+        const __m128i s = _mm_loadu_si128((const __m128i*)img);
+        const __m128i a32 = _mm_srli_epi32(s, 24);
+        const __m128i transparent = _mm_cmpeq_epi32(a32, zero);
+        const int tmask = _mm_movemask_epi8(transparent);
+
+        if(tmask == 0xFFFF)
+            continue;
+
+        if(_mm_movemask_epi8(_mm_cmpeq_epi32(a32, _mm_set1_epi32(0xFF))) == 0xFFFF)
+        {
+            _mm_storeu_si128((__m128i*)dst, s);
+            continue;
+        }
+
+        const __m128i d = _mm_loadu_si128((__m128i*)dst);
+        __m128i a = _mm_or_si128(a32, _mm_slli_epi32(a32, 8));
+        a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+
+        const __m128i a_lo = _mm_unpacklo_epi8(a, zero);
+        const __m128i a_hi = _mm_unpackhi_epi8(a, zero);
+
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(max, a_lo)),
+                                   _mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), a_lo));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(max, a_hi)),
+                                   _mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), a_hi));
+        lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(lo, one), _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(hi, one), _mm_srli_epi16(hi, 8)), 8);
+
+        __m128i res = _mm_or_si128(_mm_packus_epi16(lo, hi), opaque);
+        res = _mm_or_si128(_mm_and_si128(transparent, d), _mm_andnot_si128(transparent, res));
+        _mm_storeu_si128((__m128i*)dst, res);
+    }
+#endif
+
+    for(; x < len; ++x, ++dst, ++img)
+    {
+        alpha = PX_GET_A(*img);
+        if(alpha == 0xFF)
+            *dst = *img;
+        else if(alpha != 0x00)
+        {
+            comps_bits = (uint8_t*)dst;
+            comps_img = (const uint8_t*)img;
+            comps_bits[PX_IDX_R] = blend_png(comps_bits[PX_IDX_R], comps_img[PX_IDX_R], comps_img[PX_IDX_A]);
+            comps_bits[PX_IDX_G] = blend_png(comps_bits[PX_IDX_G], comps_img[PX_IDX_G], comps_img[PX_IDX_A]);
+            comps_bits[PX_IDX_B] = blend_png(comps_bits[PX_IDX_B], comps_img[PX_IDX_B], comps_img[PX_IDX_A]);
+            comps_bits[PX_IDX_A] = 0xFF;
+        }
+    }
+}
+
+#else // PIXEL_SIZE == 2
+
+void fb_blend_color_row(px_type *dst, int len, px_type color, uint8_t alpha)
+{
+    const uint8_t alpha5b = (alpha >> 3) + 1;
+    const uint8_t alpha6b = (alpha >> 2) + 1;
+    const uint8_t inv_alpha5b = 32 - alpha5b;
+    const uint8_t inv_alpha6b = 64 - alpha6b;
+    const uint16_t premult_color_rb = ((color & 0xF81F) * alpha5b) >> 5;
+    const uint16_t premult_color_g = ((color & 0x7E0) * alpha6b) >> 6;
+    int x = 0;
+
+#if defined(BLEND_NEON) || defined(BLEND_SSE2)
+    // The packed RB computation of the scalar path is the same
+    // as blending each channel on its own
+    const uint16_t pr = (premult_color_rb & 0xF800) >> 11;
+    const uint16_t pg = (premult_color_g & 0x7E0) >> 5;
+    const uint16_t pb = (premult_color_rb & 0x1F);
+#endif
+
+#if defined(BLEND_NEON)
+    const uint16x8_t v_pr = vdupq_n_u16(pr), v_pg = vdupq_n_u16(pg), v_pb = vdupq_n_u16(pb);
+    const uint16x8_t inv5 = vdupq_n_u16(inv_alpha5b), inv6 = vdupq_n_u16(inv_alpha6b);
+    const uint16x8_t mask5 = vdupq_n_u16(0x1F), mask6 = vdupq_n_u16(0x3F);
+
+    for(; x + 8 <= len; x += 8, dst += 8)
+    {
+        const uint16x8_t d = vld1q_u16(dst);
+        uint16x8_t r = vshrq_n_u16(d, 11);
+        uint16x8_t g = vandq_u16(vshrq_n_u16(d, 5), mask6);
+        uint16x8_t b = vandq_u16(d, mask5);
+
+        r = vaddq_u16(v_pr, vshrq_n_u16(vmulq_u16(r, inv5), 5));
+        g = vaddq_u16(v_pg, vshrq_n_u16(vmulq_u16(g, inv6), 6));
+        b = vaddq_u16(v_pb, vshrq_n_u16(vmulq_u16(b, inv5), 5));
+
+        vst1q_u16(dst, vorrq_u16(vorrq_u16(vshlq_n_u16(r, 11), vshlq_n_u16(g, 5)), b));
+    }
+#elif defined(BLEND_SSE2)
+    const __m128i v_pr = _mm_set1_epi16(pr), v_pg = _mm_set1_epi16(pg), v_pb = _mm_set1_epi16(pb);
+    const __m128i inv5 = _mm_set1_epi16(inv_alpha5b), inv6 = _mm_set1_epi16(inv_alpha6b);
+    const __m128i mask5 = _mm_set1_epi16(0x1F), mask6 = _mm_set1_epi16(0x3F);
+
+    for(; x + 8 <= len; x += 8, dst += 8)
+    {
+        const __m128i d = _mm_loadu_si128((__m128i*)dst);
+        __m128i r = _mm_srli_epi16(d, 11);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(d, 5), mask6);
+        __m128i b = _mm_and_si128(d, mask5);
+
+        r = _mm_add_epi16(v_pr, _mm_srli_epi16(_mm_mullo_epi16(r, inv5), 5));
+        g = _mm_add_epi16(v_pg, _mm_srli_epi16(_mm_mullo_epi16(g, inv6), 6));
+        b = _mm_add_epi16(v_pb, _mm_srli_epi16(_mm_mullo_epi16(b, inv5), 5));
+
+        _mm_storeu_si128((__m128i*)dst, _mm_or_si128(_mm_or_si128(_mm_slli_epi16(r, 11), _mm_slli_epi16(g, 5)), b));
+    }
+#endif
+
+    for(; x < len; ++x, ++dst)
+    {
+        const uint16_t rb = (premult_color_rb & 0xF81F) + ((inv_alpha5b * (*dst & 0xF81F)) >> 5);
+        const uint16_t g = (premult_color_g & 0x7E0) + ((inv_alpha6b * (*dst & 0x7E0)) >> 6);
+        *dst = (rb & 0xF81F) | (g & 0x7E0);
+    }
+}
+
+// img has two uint16_t per pixel: the color and the 5b and 6b alpha values
+void fb_blend_img_row(px_type *dst, const px_type *img, int len)
+{
+    int x = 0;
+
+#if defined(BLEND_NEON)
+    const uint16x8_t mask5 = vdupq_n_u16(0x1F), mask6 = vdupq_n_u16(0x3F);
+    const uint16x8_t max5 = vdupq_n_u16(31), max6 = vdupq_n_u16(63);
+    const uint16x8_t one = vdupq_n_u16(1);
+
+    for(; x + 8 <= len; x += 8, dst += 8, img += 16)
+    {
+        const uint16x8x2_t in = vld2q_u16(img);
+        const uint16x8_t s = in.val[0];
+        const uint16x8_t a5 = vandq_u16(in.val[1], vdupq_n_u16(0xFF));
+        const uint16x8_t a6 = vshrq_n_u16(in.val[1], 8);
+        const uint16x8_t transparent = vceqq_u16(a5, vdupq_n_u16(0));
+        const uint16x8_t opaque = vceqq_u16(a5, max5);
+        const uint16x8_t inv5 = vsubq_u16(max5, a5), inv6 = vsubq_u16(max6, a6);
+        const uint16x8_t d = vld1q_u16(dst);
+        uint16x8_t r, g, b;
+
+        // (x + 1 + (x >> 5)) >> 5 == x/31 for x <= 31*31, same for 63
+        r = vmlaq_u16(vmulq_u16(vshrq_n_u16(d, 11), inv5), vshrq_n_u16(s, 11), a5);
+        r = vshrq_n_u16(vaddq_u16(vaddq_u16(r, one), vshrq_n_u16(r, 5)), 5);
+        g = vmlaq_u16(vmulq_u16(vandq_u16(vshrq_n_u16(d, 5), mask6), inv6), vandq_u16(vshrq_n_u16(s, 5), mask6), a6);
+        g = vshrq_n_u16(vaddq_u16(vaddq_u16(g, one), vshrq_n_u16(g, 6)), 6);
+        b = vmlaq_u16(vmulq_u16(vandq_u16(d, mask5), inv5), vandq_u16(s, mask5), a5);
+        b = vshrq_n_u16(vaddq_u16(vaddq_u16(b, one), vshrq_n_u16(b, 5)), 5);
+
+        const uint16x8_t res = vorrq_u16(vorrq_u16(vshlq_n_u16(r, 11), vshlq_n_u16(g, 5)), b);
+        vst1q_u16(dst, vbslq_u16(transparent, d, vbslq_u16(opaque, s, res)));
+    }
+#elif defined(BLEND_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mask5 = _mm_set1_epi16(0x1F), mask6 = _mm_set1_epi16(0x3F);
+    const __m128i max5 = _mm_set1_epi16(31), max6 = _mm_set1_epi16(63);
+    const __m128i one = _mm_set1_epi16(1);
+
+    for(; x + 8 <= len; x += 8, dst += 8, img += 16)
+    {
+        const __m128i in_lo = _mm_loadu_si128((const __m128i*)img);
+        const __m128i in_hi = _mm_loadu_si128((const __m128i*)(img + 8));
+        // sign-extend the low halves so that packs doesn't saturate them
+        const __m128i s = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(in_lo, 16), 16),
+                                          _mm_srai_epi32(_mm_slli_epi32(in_hi, 16), 16));
+        const __m128i alphas = _mm_packs_epi32(_mm_srli_epi32(in_lo, 16), _mm_srli_epi32(in_hi, 16));
+        const __m128i a5 = _mm_and_si128(alphas, _mm_set1_epi16(0xFF));
+        const __m128i a6 = _mm_srli_epi16(alphas, 8);
+        const __m128i transparent = _mm_cmpeq_epi16(a5, zero);
+        const __m128i opaque = _mm_cmpeq_epi16(a5, max5);
+
+        if(_mm_movemask_epi8(transparent) == 0xFFFF)
+            continue;
+
+        const __m128i inv5 = _mm_sub_epi16(max5, a5), inv6 = _mm_sub_epi16(max6, a6);
+        const __m128i d = _mm_loadu_si128((__m128i*)dst);
+        __m128i r, g, b;
+
+        // (x + 1 + (x >> 5)) >> 5 == x/31 for x <= 31*31, same for 63
+        r = _mm_add_epi16(_mm_mullo_epi16(_mm_srli_epi16(d, 11), inv5), _mm_mullo_epi16(_mm_srli_epi16(s, 11), a5));
+        r = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(r, one), _mm_srli_epi16(r, 5)), 5);
+        g = _mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(d, 5), mask6), inv6),
+                          _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(s, 5), mask6), a6));
+        g = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(g, one), _mm_srli_epi16(g, 6)), 6);
+        b = _mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(d, mask5), inv5), _mm_mullo_epi16(_mm_and_si128(s, mask5), a5));
+        b = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(b, one), _mm_srli_epi16(b, 5)), 5);
+
+        __m128i res = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(r, 11), _mm_slli_epi16(g, 5)), b);
+        res = _mm_or_si128(_mm_and_si128(opaque, s), _mm_andnot_si128(opaque, res));
+        res = _mm_or_si128(_mm_and_si128(transparent, d), _mm_andnot_si128(transparent, res));
+        _mm_storeu_si128((__m128i*)dst, res);
+    }
+#endif
+
+    for(; x < len; ++x, ++dst, img += 2)
+    {
+        const uint8_t alpha5b = ((const uint8_t*)img)[2];
+        const uint8_t alpha6b = ((const uint8_t*)img)[3];
+
+        if(alpha5b == 31)
+            *dst = *img;
+        else if(alpha5b != 0)
+        {
+            *dst = (((31-alpha5b)*(*dst & 0x1F)            + (alpha5b*(*img & 0x1F))) / 31) |
+                   ((((63-alpha6b)*((*dst & 0x7E0) >> 5)   + (alpha6b*((*img & 0x7E0) >> 5))) / 63) << 5) |
+                   ((((31-alpha5b)*((*dst & 0xF800) >> 11) + (alpha5b*((*img & 0xF800) >> 11))) / 31) << 11);
+        }
+    }
+}
+
+#endif // PIXEL_SIZE
@@ -203,9 +203,9 @@ static int fb_qcom_vsync_wait(UNUSED struct fb_qcom_vsync *vs)
     res = pthread_cond_timedwait(&vs->cond, &vs->mutex, &ts);
     pthread_mutex_unlock(&vs->mutex);
 
-    return res;
+    return res == 0 ? 0 : -1;
 #else
-    return 0;
+    return -1;
 #endif
 }
 
@@ -634,8 +634,6 @@ static int impl_update(struct framebuffer *fb)
     memset(&ext_commit, 0, sizeof(struct mdp_display_commit));
     ext_commit.flags = MDP_DISPLAY_COMMIT_OVERLAY;
 
-    fb_qcom_vsync_wait(data->vsync);
-
     ret = ioctl(fb->fd, MSMFB_DISPLAY_COMMIT, &ext_commit);
     if(ret < 0)
     {
@@ -655,6 +653,14 @@ static void *impl_get_frame_dest(struct framebuffer *fb)
     return data->mem_info[data->active_mem].mem_buf;
 }
 
+// The draw thread paces itself to vsync with this, instead of
+// impl_update() waiting for it before each commit.
+static int impl_wait_vsync(struct framebuffer *fb)
+{
+    struct fb_qcom_overlay_data *data = fb->impl_data;
+    return fb_qcom_vsync_wait(data->vsync) == 0 ? 1 : -1;
+}
+
 const struct fb_impl fb_impl_qcom_overlay = {
     .name = "Qualcomm ION overlay",
     .impl_id = FB_IMPL_QCOM_OVERLAY,
@@ -663,4 +669,5 @@ const struct fb_impl fb_impl_qcom_overlay = {
     .close = impl_close,
     .update = impl_update,
     .get_frame_dest = impl_get_frame_dest,
+    .wait_vsync = impl_wait_vsync,
 };
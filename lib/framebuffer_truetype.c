@@ -51,10 +51,33 @@ static const char *FONT_FILES[STYLE_COUNT] = {
     "OxygenMono-Regular.ttf", // STYLE_MONOSPACE
 };
 
+// The atlas is never narrower than this, it only grows in height
+#define ATLAS_MIN_W 256
+
+struct glyph_info
+{
+    int loaded; // 0 = not yet, 1 = ok, -1 = failed to load
+    FT_UInt idx;
+    int advance;
+    int y_min, y_max; // outline's box, in pixels
+    int left, top; // bitmap's position relative to the pen
+    int w, h;
+    int atlas_x, atlas_y;
+};
+
+/*
+ * Glyphs of one style and size. Each is rasterized only once, into the atlas
+ * texture. Its pixels already have the fb_img data layout, but without the
+ * color, so composing a string is just copying them with the color OR-ed in.
+ * Glyphs are indexed by the char itself.
+ */
 struct glyphs_entry
 {
     FT_Face face;
-    imap *glyphs;
+    struct glyph_info glyphs[256];
+    uint32_t *atlas;
+    int atlas_w, atlas_h;
+    int shelf_x, shelf_y, shelf_h;
 };
 
 struct strings_entry
@@ -99,11 +122,43 @@ typedef struct
     int wrap_w;
 } text_extra;
 
-static int convert_ft_bitmap(FT_BitmapGlyph bit, px_type color, px_type *res_data, int stride, struct text_line *line, FT_Vector *pos)
+// Places a w x h area into the atlas, shelf by shelf
+static int atlas_alloc(struct glyphs_entry *en, int w, int h, int *x, int *y)
+{
+    int new_h;
+    uint32_t *new_atlas;
+
+    if(en->shelf_x + w > en->atlas_w)
+    {
+        en->shelf_y += en->shelf_h;
+        en->shelf_x = 0;
+        en->shelf_h = 0;
+    }
+
+    if(en->shelf_y + h > en->atlas_h)
+    {
+        new_h = imax(en->atlas_h*2, imax(64, en->shelf_y + h));
+        new_atlas = realloc(en->atlas, en->atlas_w*new_h*4);
+        if(!new_atlas)
+            return -1;
+
+        memset(new_atlas + en->atlas_w*en->atlas_h, 0, en->atlas_w*(new_h - en->atlas_h)*4);
+        en->atlas = new_atlas;
+        en->atlas_h = new_h;
+    }
+
+    *x = en->shelf_x;
+    *y = en->shelf_y;
+    en->shelf_x += w;
+    en->shelf_h = imax(en->shelf_h, h);
+    return 0;
+}
+
+static int atlas_add_bitmap(struct glyphs_entry *en, struct glyph_info *g, FT_BitmapGlyph bit)
 {
     int x, y;
     uint8_t *buff;
-    px_type *res_itr;
+    uint32_t *itr;
 
     if(bit->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY)
     {
@@ -111,35 +166,72 @@ static int convert_ft_bitmap(FT_BitmapGlyph bit, px_type color, px_type *res_dat
         return -1;
     }
 
-    //INFO("Bitmap w %d baseline %d pos [%d; %d] left %d top %d rows %d cols %d pitch %d\n", line->w, line->base, pos->x, pos->y, bit->left, bit->top, bit->bitmap.rows, bit->bitmap.width, bit->bitmap.pitch);
+    g->left = bit->left;
+    g->top = bit->top;
+    g->w = imin(bit->bitmap.width, en->atlas_w);
+    g->h = bit->bitmap.rows;
 
-    buff = (uint8_t*)bit->bitmap.buffer;
-    res_itr = (px_type*)(((uint32_t*)res_data) + (line->offY + line->base - bit->top)*stride + (line->offX + pos->x + bit->left));
+    if(g->w == 0 || g->h == 0)
+        return 0;
 
-    // FIXME: if bit->left is negative and everything else is 0 (e.g. letter 'j' in Roboto-Regular),
-    // the result might end up being before the buffer - I'm not sure how to properly handle this.
-    if(res_itr < res_data)
-        res_itr = res_data;
+    if(atlas_alloc(en, g->w, g->h, &g->atlas_x, &g->atlas_y) < 0)
+    {
+        g->w = g->h = 0;
+        return -1;
+    }
 
-    for(y = 0; y < bit->bitmap.rows; ++y)
+    buff = (uint8_t*)bit->bitmap.buffer;
+    itr = en->atlas + g->atlas_y*en->atlas_w + g->atlas_x;
+
+    for(y = 0; y < g->h; ++y)
     {
-        for(x = 0; x < bit->bitmap.width; ++x)
+        for(x = 0; x < g->w; ++x)
         {
 #if PIXEL_SIZE == 4
-            *res_itr++ = color | (buff[x] << ((PX_IDX_A*8)));
+            itr[x] = ((uint32_t)buff[x]) << (PX_IDX_A*8);
 #else
-            *res_itr++ = color;
-            ((uint8_t*)res_itr)[0] = ((((buff[x]*100)/0xFF)*31)/100);
-            ((uint8_t*)res_itr)[1] = ((((buff[x]*100)/0xFF)*63)/100);
-            ++res_itr;
+            // color, alpha 5b, alpha 6b
+            ((uint8_t*)&itr[x])[2] = ((((buff[x]*100)/0xFF)*31)/100);
+            ((uint8_t*)&itr[x])[3] = ((((buff[x]*100)/0xFF)*63)/100);
 #endif
         }
         buff += bit->bitmap.pitch;
-        res_itr = (px_type*)(((uint32_t*)res_itr) + stride - bit->bitmap.width);
+        itr += en->atlas_w;
     }
     return 0;
 }
 
+static struct glyph_info *get_glyph(struct glyphs_entry *en, char c)
+{
+    FT_Glyph glyph;
+    FT_BBox bbox;
+    struct glyph_info *g = &en->glyphs[(uint8_t)c];
+
+    if(g->loaded != 0)
+        return g;
+
+    g->loaded = -1;
+    g->idx = FT_Get_Char_Index(en->face, c);
+
+    if(FT_Load_Glyph(en->face, g->idx, FT_LOAD_DEFAULT) != 0)
+        return g;
+
+    if(FT_Get_Glyph(en->face->glyph, &glyph) != 0)
+        return g;
+
+    FT_Glyph_Get_CBox(glyph, ft_glyph_bbox_pixels, &bbox);
+    g->y_min = bbox.yMin;
+    g->y_max = bbox.yMax;
+    g->advance = glyph->advance.x >> 16;
+    g->loaded = 1;
+
+    if(FT_Glyph_To_Bitmap(&glyph, FT_RENDER_MODE_NORMAL, NULL, 1) == 0)
+        atlas_add_bitmap(en, g, (FT_BitmapGlyph)glyph);
+
+    FT_Done_Glyph(glyph);
+    return g;
+}
+
 static struct glyphs_entry *get_cache_for_size(int style, const int size)
 {
     int error;
@@ -190,7 +282,7 @@ retry_load:
             return NULL;
         }
 
-        res->glyphs = imap_create();
+        res->atlas_w = imax(ATLAS_MIN_W, (res->face->size->metrics.max_advance >> 6)*8);
         imap_add_not_exist(cache.glyphs[style], size, res);
     }
 
@@ -222,7 +314,7 @@ static void add_to_strings(fb_img *img)
     map *c = imap_get_val(cache.strings, ex->size);
     if(!c)
     {
-        c = map_create();
+        c = map_create_hashed();
         imap_add_not_exist(cache.strings, ex->size, c);
     }
     else if(map_find(c, ex->text) != -1)
@@ -259,11 +351,11 @@ static int unlink_from_caches(text_extra *ex)
 
 static int measure_line(struct text_line *line, struct glyphs_entry **gen, int8_t *style_map, text_extra *ex)
 {
-    int i, penX, penY, idx, prev_idx, error, last_space, wrapped;
+    int i, penX, penY, idx, prev_idx, last_space, wrapped;
     FT_Vector delta;
-    FT_Glyph glyph;
+    struct glyph_info *glyph;
     struct glyphs_entry *en;
-    FT_BBox bbox, glyph_bbox;
+    FT_BBox bbox;
     bbox.yMin = LONG_MAX;
     bbox.yMax = LONG_MIN;
 
@@ -276,7 +368,8 @@ static int measure_line(struct text_line *line, struct glyphs_entry **gen, int8_
             continue;
 
         en = gen[*style_map];
-        idx = FT_Get_Char_Index(en->face, line->text[i]);
+        glyph = get_glyph(en, line->text[i]);
+        idx = glyph->idx;
 
         if(FT_HAS_KERNING(en->face) && prev_idx && idx)
         {
@@ -298,28 +391,16 @@ static int measure_line(struct text_line *line, struct glyphs_entry **gen, int8_
         if(isspace(line->text[i]))
             last_space = i;
 
-        glyph = imap_get_val(en->glyphs, (int)line->text[i]);
-        if(!glyph)
-        {
-            error = FT_Load_Glyph(en->face, idx, FT_LOAD_DEFAULT);
-            if(error)
-                continue;
-
-            error = FT_Get_Glyph(en->face->glyph, &glyph);
-            if(error)
-                continue;
-
-            imap_add_not_exist(en->glyphs, (int)line->text[i], glyph);
-        }
+        if(glyph->loaded != 1)
+            continue;
 
-        FT_Glyph_Get_CBox(glyph, ft_glyph_bbox_pixels, &glyph_bbox);
-        bbox.yMin = imin(bbox.yMin, glyph_bbox.yMin);
-        bbox.yMax = imax(bbox.yMax, glyph_bbox.yMax);
+        bbox.yMin = imin(bbox.yMin, glyph->y_min);
+        bbox.yMax = imax(bbox.yMax, glyph->y_max);
 
         line->pos[i].x = penX;
         line->pos[i].y = penY;
 
-        penX += glyph->advance.x >> 16;
+        penX += glyph->advance;
         prev_idx = idx;
     }
 
@@ -332,24 +413,45 @@ static int measure_line(struct text_line *line, struct glyphs_entry **gen, int8_
     return wrapped;
 }
 
-static void render_line(struct text_line *line, struct glyphs_entry **gen, int8_t *style_map, px_type *res_data, int stride, px_type converted_color)
+static void render_line(struct text_line *line, struct glyphs_entry **gen, int8_t *style_map, px_type *res_data, int stride, int res_h, px_type converted_color)
 {
-    int i, error;
-    FT_Glyph *image;
-    FT_BitmapGlyph bit;
+    int i, x, y, x0, y0, min_x, min_y, max_x, max_y;
     struct glyphs_entry *en;
+    struct glyph_info *g;
+    const uint32_t *src;
+    uint32_t *dst;
+    union {
+        uint32_t u;
+        px_type px[4/PIXEL_SIZE];
+    } color = { 0 };
+
+    color.px[0] = converted_color;
 
     for(i = 0; i < line->len; ++i, ++style_map)
     {
         if(*style_map == -1)
             continue;
 
-        image = imap_get_ref(gen[*style_map]->glyphs, (int)line->text[i]); // pre-cached from measure_line()
-        error = FT_Glyph_To_Bitmap(image, FT_RENDER_MODE_NORMAL, NULL, 1);
-        if(error == 0)
+        en = gen[*style_map];
+        g = &en->glyphs[(uint8_t)line->text[i]]; // loaded by measure_line()
+        if(g->loaded != 1 || g->w == 0)
+            continue;
+
+        x0 = line->offX + line->pos[i].x + g->left;
+        y0 = line->offY + line->base - g->top;
+
+        // glyphs like 'j' can reach a bit outside of the line
+        min_x = imax(0, -x0);
+        min_y = imax(0, -y0);
+        max_x = imin(g->w, stride - x0);
+        max_y = imin(g->h, res_h - y0);
+
+        for(y = min_y; y < max_y; ++y)
         {
-            bit = (FT_BitmapGlyph)(*image);
-            convert_ft_bitmap(bit, converted_color, res_data, stride, line, &line->pos[i]);
+            src = en->atlas + (g->atlas_y + y)*en->atlas_w + g->atlas_x;
+            dst = ((uint32_t*)res_data) + (y0 + y)*stride + x0;
+            for(x = min_x; x < max_x; ++x)
+                dst[x] = src[x] | color.u;
         }
     }
 }
@@ -527,7 +629,7 @@ static void fb_text_render(fb_img *img)
     img->data = mzalloc(maxW*totalH*4);
 
     for(i = 0; i < lines_cnt; ++i)
-        render_line(lines[i], gen, style_map + (lines[i]->text - ex->text), img->data, maxW, ex->color);
+        render_line(lines[i], gen, style_map + (lines[i]->text - ex->text), img->data, maxW, totalH, ex->color);
 
     img->w = maxW;
     img->h = totalH;
@@ -662,6 +764,8 @@ void fb_text_set_color(fb_img *img, uint32_t color)
     }
 
     fb_items_unlock();
+
+    fb_damage_item(img);
 }
 
 void fb_text_set_size(fb_img *img, int size)
@@ -682,6 +786,8 @@ void fb_text_set_size(fb_img *img, int size)
     ex->size = size;
     fb_text_render(img);
     fb_items_unlock();
+
+    fb_damage_item(img);
 }
 
 void fb_text_set_content(fb_img *img, const char *text)
@@ -703,6 +809,8 @@ void fb_text_set_content(fb_img *img, const char *text)
     strcpy(ex->text, text);
     fb_text_render(img);
     fb_items_unlock();
+
+    fb_damage_item(img);
 }
 
 char *fb_text_get_content(fb_img *img)
@@ -750,7 +858,7 @@ static int drop_glyphs_cache(imap *g_cache)
     {
         const int key = g_cache->keys[i];
         struct glyphs_entry *en = g_cache->values[i];
-        imap_destroy(en->glyphs, (void*)&FT_Done_Glyph);
+        free(en->atlas);
         FT_Done_Face(en->face);
         imap_rm(g_cache, key, &free);
     }
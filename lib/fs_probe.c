@@ -0,0 +1,152 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "fs_probe.h"
+
+#define PROBE_SIZE 4096
+
+#define EXT_SB_OFFSET 1024
+#define EXT_MAGIC 0xEF53
+#define EXT3_FEATURE_COMPAT_HAS_JOURNAL 0x0004
+#define EXT4_FEATURE_RO_COMPAT_MASK (0x0008 | 0x0010 | 0x0020 | 0x0040) // huge_file, gdt_csum, dir_nlink, extra_isize
+#define EXT4_FEATURE_INCOMPAT_MASK (0x0040 | 0x0080 | 0x0100 | 0x0200) // extents, 64bit, mmp, flex_bg
+
+#define F2FS_SB_OFFSET 1024
+#define F2FS_MAGIC 0xF2F52010
+
+static inline uint16_t le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void format_uuid_dce(char *out, const uint8_t *u)
+{
+    sprintf(out, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+            u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7],
+            u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+}
+
+static void format_uuid_dos(char *out, const uint8_t *s)
+{
+    sprintf(out, "%02X%02X-%02X%02X", s[3], s[2], s[1], s[0]);
+}
+
+static int probe_ext(const uint8_t *buf, struct fs_probe_res *res)
+{
+    const uint8_t *sb = buf + EXT_SB_OFFSET;
+
+    if(le16(sb + 0x38) != EXT_MAGIC)
+        return -1;
+
+    if((le32(sb + 0x64) & EXT4_FEATURE_RO_COMPAT_MASK) || (le32(sb + 0x60) & EXT4_FEATURE_INCOMPAT_MASK))
+        strcpy(res->type, "ext4");
+    else if(le32(sb + 0x5C) & EXT3_FEATURE_COMPAT_HAS_JOURNAL)
+        strcpy(res->type, "ext3");
+    else
+        strcpy(res->type, "ext2");
+
+    format_uuid_dce(res->uuid, sb + 0x68);
+    return 0;
+}
+
+static int probe_f2fs(const uint8_t *buf, struct fs_probe_res *res)
+{
+    const uint8_t *sb = buf + F2FS_SB_OFFSET;
+
+    if(le32(sb) != F2FS_MAGIC)
+        return -1;
+
+    strcpy(res->type, "f2fs");
+    format_uuid_dce(res->uuid, sb + 0x6C);
+    return 0;
+}
+
+static int probe_boot_sector(const uint8_t *buf, struct fs_probe_res *res)
+{
+    uint16_t sector_size;
+    uint8_t cluster_size;
+    int i;
+
+    if(buf[510] != 0x55 || buf[511] != 0xAA)
+        return -1;
+
+    if(memcmp(buf + 3, "EXFAT   ", 8) == 0)
+    {
+        strcpy(res->type, "exfat");
+        format_uuid_dos(res->uuid, buf + 100);
+        return 0;
+    }
+
+    if(memcmp(buf + 3, "NTFS    ", 8) == 0)
+    {
+        strcpy(res->type, "ntfs");
+        for(i = 0; i < 8; ++i)
+            sprintf(res->uuid + i*2, "%02X", buf[0x48 + 7 - i]);
+        return 0;
+    }
+
+    // MBR has the same signature, so check the BPB looks sane
+    sector_size = le16(buf + 11);
+    cluster_size = buf[13];
+    if(sector_size < 512 || sector_size > 4096 || (sector_size & (sector_size - 1)) ||
+        cluster_size == 0 || (cluster_size & (cluster_size - 1)) ||
+        le16(buf + 14) == 0 || buf[16] == 0)
+    {
+        return -1;
+    }
+
+    strcpy(res->type, "vfat");
+    // FAT32 has 0 in the 16-bit sectors-per-FAT field
+    if(le16(buf + 22) == 0 || memcmp(buf + 82, "FAT32   ", 8) == 0)
+        format_uuid_dos(res->uuid, buf + 67);
+    else
+        format_uuid_dos(res->uuid, buf + 39);
+    return 0;
+}
+
+int fs_probe(const char *path, struct fs_probe_res *res)
+{
+    uint8_t buf[PROBE_SIZE];
+    ssize_t len;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+
+    len = pread(fd, buf, sizeof(buf), 0);
+    close(fd);
+
+    if(len != sizeof(buf))
+        return -1;
+
+    memset(res, 0, sizeof(struct fs_probe_res));
+    if(probe_ext(buf, res) == 0 || probe_f2fs(buf, res) == 0 || probe_boot_sector(buf, res) == 0)
+        return 0;
+    return -1;
+}
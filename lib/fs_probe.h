@@ -0,0 +1,33 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FS_PROBE_H
+#define FS_PROBE_H
+
+struct fs_probe_res
+{
+    char uuid[40];
+    char type[8];
+};
+
+// Identifies ext2/3/4, f2fs, vfat, exfat and ntfs from the first few KB
+// of the device. UUIDs are formatted the same way busybox blkid does,
+// because they are stored in multirom.ini.
+// Returns 0 if a known filesystem was found.
+int fs_probe(const char *path, struct fs_probe_res *res);
+
+#endif
@@ -22,6 +22,8 @@
 #include <stdio.h>
 
 #include "inject.h"
+#include "cpio.h"
+#include "ramdisk.h"
 #include "mrom_data.h"
 #include "log.h"
 #include "util.h"
@@ -35,94 +37,56 @@
 #error "libbootimg version 0.2.0 or higher is required. Please update libbootimg."
 #endif
 
-#define TMP_RD_UNPACKED_DIR "/mrom_rd"
-#define TMP_RD2 TMP_RD_UNPACKED_DIR "/sbin/ramdisk.cpio"
-#define TMP_RD2_UNPACKED_DIR TMP_RD_UNPACKED_DIR "/second"
+#ifndef MR_RD_COMPRESSION_LEVEL
+#define MR_RD_COMPRESSION_LEVEL RD_LEVEL_DEFAULT
+#endif
 
-static int get_img_trampoline_ver(struct bootimg *img)
+static int get_img_trampoline_ver(struct boot_img_hdr *hdr)
 {
     int ver = 0;
-    if(strncmp((char*)img->hdr.name, "tr_ver", 6) == 0)
-        ver = atoi((char*)img->hdr.name + 6);
+    if(strncmp((char*)hdr->name, "tr_ver", 6) == 0)
+        ver = atoi((char*)hdr->name + 6);
     return ver;
 }
 
-static int copy_rd_files(UNUSED const char *path, UNUSED const char *busybox_path)
+static int copy_rd_files(struct cpio_archive *a, const char *init_name)
 {
     char buf[256];
-    char path_dir[64];
-    char path_init[64];
-    char path_main[64];
-    char path_mrom_enc[64];
-    char path_mrom_fstab[64];
-    char path_hwservice_contexts[64];
-    char path_nonplat_hwservice_contexts[64];
-    char path_ueventd[64];
-    char path_watchdog[64];
-
-    if (access(TMP_RD2, F_OK) != -1)
-    {
-        snprintf(path_dir, sizeof(path_dir), TMP_RD2_UNPACKED_DIR);
-        snprintf(path_init, sizeof(path_init), TMP_RD2_UNPACKED_DIR "/init");
-        snprintf(path_main, sizeof(path_main), TMP_RD2_UNPACKED_DIR "/main_init");
-        snprintf(path_mrom_enc, sizeof(path_mrom_enc), TMP_RD2_UNPACKED_DIR "/mrom_enc");
-        snprintf(path_mrom_fstab, sizeof(path_mrom_fstab), TMP_RD2_UNPACKED_DIR "/mrom.fstab");
-        snprintf(path_hwservice_contexts, sizeof(path_hwservice_contexts), TMP_RD2_UNPACKED_DIR "/plat_hwservice_contexts");
-        snprintf(path_nonplat_hwservice_contexts, sizeof(path_nonplat_hwservice_contexts), TMP_RD2_UNPACKED_DIR "/nonplat_hwservice_contexts");
-        snprintf(path_ueventd, sizeof(path_ueventd), TMP_RD2_UNPACKED_DIR "/sbin/ueventd");
-        snprintf(path_watchdog, sizeof(path_watchdog), TMP_RD2_UNPACKED_DIR "/sbin/watchdogd");
-    }
-    else
-    {
-        snprintf(path_dir, sizeof(path_dir), TMP_RD_UNPACKED_DIR);
-        if (access(TMP_RD_UNPACKED_DIR "/init.real", F_OK) != -1) {
-            snprintf(path_init, sizeof(path_init), TMP_RD_UNPACKED_DIR "/init.real");
-        } else {
-            snprintf(path_init, sizeof(path_init), TMP_RD_UNPACKED_DIR "/init");
-        }
-        snprintf(path_main, sizeof(path_main), TMP_RD_UNPACKED_DIR "/main_init");
-        snprintf(path_mrom_enc, sizeof(path_mrom_enc), TMP_RD_UNPACKED_DIR "/mrom_enc");
-        snprintf(path_mrom_fstab, sizeof(path_mrom_fstab), TMP_RD_UNPACKED_DIR "/mrom.fstab");
-        snprintf(path_hwservice_contexts, sizeof(path_hwservice_contexts), TMP_RD_UNPACKED_DIR "/plat_hwservice_contexts");
-        snprintf(path_nonplat_hwservice_contexts, sizeof(path_nonplat_hwservice_contexts), TMP_RD_UNPACKED_DIR "/nonplat_hwservice_contexts");
-        snprintf(path_ueventd, sizeof(path_ueventd), TMP_RD_UNPACKED_DIR "/sbin/ueventd");
-        snprintf(path_watchdog, sizeof(path_watchdog), TMP_RD_UNPACKED_DIR "/sbin/watchdogd");
-    }
 
-    if (access(path_main, F_OK) < 0 &&
-            rename(path_init, path_main))
+    if(!cpio_find(a, "main_init") && cpio_rename(a, init_name, "main_init") < 0)
     {
-        ERROR("Failed to move %s to %s!\n", path_init, path_main);
+        ERROR("Failed to move %s to main_init!\n", init_name);
         return -1;
     }
     snprintf(buf, sizeof(buf), "%s/trampoline", mrom_dir());
-    if(copy_file(buf, path_init) < 0)
+    if(!cpio_set_file(a, init_name, buf, 0750))
     {
-        ERROR("Failed to copy trampoline to %s!\n", path_init);
+        ERROR("Failed to copy trampoline to %s!\n", init_name);
         return -1;
     }
-    chmod(path_init, 0750);
 
-    remove(path_ueventd);
-    remove(path_watchdog);
-    symlink("../main_init", path_ueventd);
-    symlink("../main_init", path_watchdog);
+    if(cpio_find(a, "sbin"))
+    {
+        cpio_set_symlink(a, "sbin/ueventd", "../main_init");
+        cpio_set_symlink(a, "sbin/watchdogd", "../main_init");
+    }
 
 #ifdef MR_USE_MROM_FSTAB
     snprintf(buf, sizeof(buf), "%s/mrom.fstab", mrom_dir());
-    copy_file(buf, path_mrom_fstab);
+    cpio_set_file(a, "mrom.fstab", buf, 0);
 #else
-    remove(path_mrom_fstab);
+    cpio_rm(a, "mrom.fstab");
 #endif
     snprintf(buf, sizeof(buf), "%s/plat_hwservice_contexts", mrom_dir());
-    copy_file(buf, path_hwservice_contexts);
+    cpio_set_file(a, "plat_hwservice_contexts", buf, 0);
     snprintf(buf, sizeof(buf), "%s/nonplat_hwservice_contexts", mrom_dir());
-    copy_file(buf, path_nonplat_hwservice_contexts);
+    cpio_set_file(a, "nonplat_hwservice_contexts", buf, 0);
 
 #ifdef MR_ENCRYPTION
-    remove_dir(path_mrom_enc);
+    cpio_rm(a, "mrom_enc");
 
-    if (mr_system("busybox cp -a \"%s/enc\" \"%s/mrom_enc\"", mrom_dir(), path_dir) != 0)
+    snprintf(buf, sizeof(buf), "%s/enc", mrom_dir());
+    if(cpio_add_tree(a, "mrom_enc", buf) < 0)
     {
         ERROR("Failed to copy encryption files!\n");
         return -1;
@@ -131,148 +95,123 @@ static int copy_rd_files(UNUSED const char *path, UNUSED const char *busybox_pat
     return 0;
 }
 
-#define RD_GZIP 1
-#define RD_LZ4  2
-static int inject_second_rd(const char *path, const char *second_path)
+// Some devices keep the real ramdisk as uncompressed cpio in
+// sbin/ramdisk.cpio, update that one instead of the outer one.
+static int inject_second_rd(struct cpio_archive *a, struct cpio_entry *second)
 {
-    int result = -1;
-    uint32_t magic = 0;
+    struct cpio_archive *sub;
+    uint8_t *data;
+    size_t size;
 
-    FILE *f = fopen(path, "re");
-    if(!f)
+    sub = cpio_parse(second->data, second->size);
+    if(!sub)
     {
-        ERROR("Couldn't open %s!\n", path);
+        ERROR("Failed to parse %s!\n", second->name);
         return -1;
     }
-    fread(&magic, sizeof(magic), 1, f);
-    fclose(f);
-
-    mkdir(TMP_RD2_UNPACKED_DIR, 0755);
-
-    // Decompress initrd
-    int type;
-    char buff[256];
-    char busybox_path[256];
-    snprintf(busybox_path, sizeof(busybox_path), "%s/busybox", mrom_dir());
 
-    char *cmd[] = { busybox_path, "sh", "-c", buff, NULL };
-
-    snprintf(buff, sizeof(buff), "B=\"%s\"; cd \"%s\"; \"$B\" cat \"%s\" | \"$B\" cpio -i", busybox_path, TMP_RD2_UNPACKED_DIR, second_path);
-
-    int r;
-    char *out = run_get_stdout_with_exit(cmd, &r);
-    if (r != 0)
+    if(copy_rd_files(sub, "init") < 0)
     {
-        ERROR("Output: %s\n", out);
-        ERROR("Failed to unpack second ramdisk!%s\n", buff);
-        goto fail;
+        cpio_destroy(sub);
+        return -1;
     }
 
-    // Update files
-    if (copy_rd_files(second_path, busybox_path) < 0)
+    data = cpio_write(sub, &size);
+    cpio_destroy(sub);
+    if(!data)
     {
-        goto fail;
+        ERROR("Failed to pack %s!\n", second->name);
+        return -1;
     }
 
-    // Pack initrd again
-    snprintf(buff, sizeof(buff), "B=\"%s\"; cd \"%s\"; \"$B\" find . | \"$B\" cpio -o -H newc > \"%s\"", busybox_path, TMP_RD2_UNPACKED_DIR, second_path);
-
-    out = run_get_stdout_with_exit(cmd, &r);
-    if (r != 0)
-    {
-        ERROR("Output: %s\n", out);
-        ERROR("Failed to pack ramdisk.cpio!\n");
-        goto fail;
-    }
-success:
-    result = 0;
-fail:
-    remove_dir(TMP_RD2_UNPACKED_DIR);
-    return result;
+    cpio_set_data(a, second->name, 0, data, size);
+    return 0;
 }
 
-static int inject_rd(const char *path, const char *second_path)
+static int inject_rd(const char *path)
 {
     int result = -1;
+    int type;
     uint32_t magic = 0;
+    uint8_t *data, *rd = NULL, *packed = NULL;
+    size_t size, rd_size, packed_size;
+    struct cpio_archive *a = NULL;
+    struct cpio_entry *second;
 
-    FILE *f = fopen(path, "re");
-    if (!f)
+    data = read_whole_file(path, &size);
+    if(!data)
     {
         ERROR("Couldn't open %s!\n", path);
         return -1;
     }
-    fread(&magic, sizeof(magic), 1, f);
-    fclose(f);
-
-    remove_dir(TMP_RD_UNPACKED_DIR);
-    mkdir(TMP_RD_UNPACKED_DIR, 0755);
-
-    // Decompress initrd
-    int type;
-    char buff[256];
-    char busybox_path[256];
-    snprintf(busybox_path, sizeof(busybox_path), "%s/busybox", mrom_dir());
-
-    char *cmd[] = { busybox_path, "sh", "-c", buff, NULL };
 
-    if((magic & 0xFFFF) == 0x8B1F)
-    {
-        type = RD_GZIP;
-        snprintf(buff, sizeof(buff), "B=\"%s\"; cd \"%s\"; \"$B\" gzip -d -c \"%s\" | \"$B\" cpio -i", busybox_path, TMP_RD_UNPACKED_DIR, path);
-    }
-    else if(magic == 0x184C2102)
+    type = rd_get_type(data, size);
+    if(type == RD_UNKNOWN)
     {
-        type = RD_LZ4;
-        snprintf(buff, sizeof(buff), "cd \"%s\"; \"%s/lz4\" -d \"%s\" stdout | \"%s\" cpio -i", TMP_RD_UNPACKED_DIR, mrom_dir(), path, busybox_path);
+        memcpy(&magic, data, imin(size, sizeof(magic)));
+        ERROR("Unknown ramdisk magic 0x%08X, can't update trampoline\n", magic);
+        result = 0;
+        goto exit;
     }
-    else
+
+    rd = rd_decompress(type, data, size, &rd_size);
+    if(!rd)
     {
-        ERROR("Unknown ramdisk magic 0x%08X, can't update trampoline\n", magic);
-        goto success;
+        ERROR("Failed to decompress ramdisk!\n");
+        goto exit;
     }
 
-    int r = run_cmd(cmd);
-    if(r != 0)
+    // the compressed data isn't needed anymore, free it before
+    // the archive gets copied again
+    free(data);
+    data = NULL;
+
+    a = cpio_parse(rd, rd_size);
+    if(!a)
     {
-        ERROR("Failed to unpack ramdisk! %s\n", buff);
-        goto fail;
+        ERROR("Failed to unpack ramdisk!\n");
+        goto exit;
     }
 
-    if (access(TMP_RD2, F_OK) != -1)
+    second = cpio_find(a, "sbin/ramdisk.cpio");
+    if(second)
     {
-        if (inject_second_rd(path, second_path) < 0)
-        {
-            goto fail;
-        }
+        if(inject_second_rd(a, second) < 0)
+            goto exit;
     }
-    else if (copy_rd_files(path, busybox_path) < 0)
+    else if(copy_rd_files(a, cpio_find(a, "init.real") ? "init.real" : "init") < 0)
+        goto exit;
+
+    packed = cpio_write(a, &packed_size);
+    if(!packed)
     {
-        goto fail;
+        ERROR("Failed to pack ramdisk!\n");
+        goto exit;
     }
 
-    // Pack ramdisk
-    switch (type)
+    cpio_destroy(a);
+    a = NULL;
+    free(rd);
+
+    rd = rd_compress(type, MR_RD_COMPRESSION_LEVEL, packed, packed_size, &rd_size);
+    if(!rd)
     {
-        case RD_GZIP:
-            snprintf(buff, sizeof(buff), "B=\"%s\"; cd \"%s\"; \"$B\" find . | \"$B\" cpio -o -H newc | \"$B\" gzip > \"%s\"", busybox_path, TMP_RD_UNPACKED_DIR, path);
-            break;
-        case RD_LZ4:
-            snprintf(buff, sizeof(buff), "B=\"%s\"; cd \"%s\"; \"$B\" find . | \"$B\" cpio -o -H newc | \"%s/lz4\" stdin \"%s\"", busybox_path, TMP_RD_UNPACKED_DIR, mrom_dir(), path);
-            break;
+        ERROR("Failed to compress ramdisk!\n");
+        goto exit;
     }
 
-    r = run_cmd(cmd);
-    if(r != 0)
+    if(write_whole_file(path, rd, rd_size) < 0)
     {
-        ERROR("Failed to pack ramdisk!\n");
-        goto fail;
+        ERROR("Failed to write ramdisk to %s!\n", path);
+        goto exit;
     }
 
-success:
     result = 0;
-fail:
-    remove_dir(TMP_RD_UNPACKED_DIR);
+exit:
+    cpio_destroy(a);
+    free(packed);
+    free(rd);
+    free(data);
     return result;
 }
 
@@ -280,10 +219,10 @@ int inject_bootimg(const char *img_path, int force)
 {
     int res = -1;
     struct bootimg img;
+    struct boot_img_hdr hdr;
     int img_ver;
     char initrd_path[256];
     static const char *initrd_tmp_name = "/inject-initrd.img";
-    static const char *initrd2_tmp_name = "/mrom_rd/sbin/ramdisk.cpio";
 
 #ifdef BOARD_BOOTIMAGE_PARTITION_SIZE
     if(access(img_path, F_OK) == 0)
@@ -293,13 +232,22 @@ int inject_bootimg(const char *img_path, int force)
     }
 #endif
 
+    // Only the header is needed to check the version, don't read
+    // the whole image unless it has to be updated.
+    if(!force && libbootimg_load_header(&hdr, img_path) >= 0 &&
+        get_img_trampoline_ver(&hdr) == VERSION_TRAMPOLINE)
+    {
+        INFO("No need to update trampoline.\n");
+        return 0;
+    }
+
     if(libbootimg_init_load(&img, img_path, LIBBOOTIMG_LOAD_ALL) < 0)
     {
         ERROR("Could not open boot image (%s)!\n", img_path);
         return -1;
     }
 
-    img_ver = get_img_trampoline_ver(&img);
+    img_ver = get_img_trampoline_ver(&img.hdr);
     if(!force && img_ver == VERSION_TRAMPOLINE)
     {
         INFO("No need to update trampoline.\n");
@@ -315,7 +263,7 @@ int inject_bootimg(const char *img_path, int force)
         goto exit;
     }
 
-    if(inject_rd(initrd_tmp_name, initrd2_tmp_name) >= 0)
+    if(inject_rd(initrd_tmp_name) >= 0)
     {
         // Update the boot.img
         snprintf((char*)img.hdr.name, BOOT_NAME_SIZE, "tr_ver%d", VERSION_TRAMPOLINE);
@@ -19,8 +19,11 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/poll.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
 #include <linux/input.h>
 #include <linux/kd.h>
@@ -48,6 +51,7 @@ int mt_range_y[2] = { 0 };
 static struct pollfd ev_fds[MAX_DEVICES];
 static unsigned ev_count = 0;
 static volatile int input_run = 0;
+static int input_wake_fd = -1; // eventfd, wakes up the input thread on stop
 
 static int key_queue[10];
 static int8_t key_itr = 10;
@@ -117,10 +121,17 @@ static int ev_init(void)
         if(strncmp(de->d_name,"event",5))
             continue;
 
-        fd = openat(dirfd(dir), de->d_name, O_RDONLY | O_CLOEXEC);
+        fd = openat(dirfd(dir), de->d_name, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
         if(fd < 0)
             continue;
 
+#ifdef EVIOCSCLOCKID
+        // Event timestamps are only ever diffed against each other,
+        // don't let wall clock changes mess up the velocity tracking.
+        int clk = CLOCK_MONOTONIC;
+        ioctl(fd, EVIOCSCLOCKID, &clk);
+#endif
+
         ev_fds[ev_count].fd = fd;
         ev_fds[ev_count].events = POLLIN;
 
@@ -150,26 +161,6 @@ static void ev_exit(void)
     }
 }
 
-static int ev_get(struct input_event *ev, unsigned dont_wait)
-{
-    int r;
-    unsigned n;
-
-    do {
-        r = poll(ev_fds, ev_count, dont_wait ? 0 : -1);
-
-        if(r > 0) {
-            for(n = 0; n < ev_count; n++) {
-                if(ev_fds[n].revents & POLLIN) {
-                    r = read(ev_fds[n].fd, ev, sizeof(*ev));
-                    if(r == sizeof(*ev)) return 0;
-                }
-            }
-        }
-    } while(dont_wait == 0);
-
-    return -1;
-}
 
 #define IS_KEY_HANDLED(key) (key >= KEY_VOLUMEDOWN && key <= KEY_POWER)
 
@@ -294,10 +285,37 @@ void touch_commit_events(struct timeval ev_time)
     }
 }
 
+static void handle_event(struct input_event *ev)
+{
+    switch(ev->type)
+    {
+        case EV_KEY:
+            handle_key_event(ev);
+            break;
+        case EV_ABS:
+            handle_abs_event(ev);
+            break;
+        case EV_SYN:
+            handle_syn_event(ev);
+            break;
+    }
+}
+
+#define INPUT_READ_EVENTS 64
 static void *input_thread_work(UNUSED void *cookie)
 {
+    struct pollfd fds[MAX_DEVICES+1];
+    struct input_event evs[INPUT_READ_EVENTS];
+    unsigned n, nfds;
+    ssize_t len, i;
+
     ev_init();
-    struct input_event ev;
+
+    // devices + the wake up eventfd as the last one
+    memcpy(fds, ev_fds, ev_count*sizeof(struct pollfd));
+    fds[ev_count].fd = input_wake_fd;
+    fds[ev_count].events = POLLIN;
+    nfds = ev_count + 1;
 
     memset(mt_events, 0, sizeof(mt_events));
 
@@ -308,25 +326,40 @@ static void *input_thread_work(UNUSED void *cookie)
     pthread_cond_broadcast(&input_start_cond);
     pthread_mutex_unlock(&input_start_mutex);
 
-    int res;
     while(input_run)
     {
-        while(ev_get(&ev, 1) == 0)
+        if(poll(fds, nfds, -1) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            ERROR("input: poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        // One read per device and poll() call, so that a busy touchscreen
+        // can't starve the keys. Leftovers make the next poll() return
+        // right away.
+        for(n = 0; n < ev_count; ++n)
         {
-            switch(ev.type)
+            if(!fds[n].revents)
+                continue;
+
+            len = read(fds[n].fd, evs, sizeof(evs));
+            if(len < 0)
             {
-                case EV_KEY:
-                    handle_key_event(&ev);
-                    break;
-                case EV_ABS:
-                    handle_abs_event(&ev);
-                    break;
-                case EV_SYN:
-                    handle_syn_event(&ev);
-                    break;
+                if(errno != EAGAIN && errno != EINTR)
+                {
+                    // device is gone, poll() ignores negative fds
+                    ERROR("input: failed to read from device %u: %s\n", n, strerror(errno));
+                    fds[n].fd = -1;
+                }
+                continue;
             }
+
+            len /= sizeof(struct input_event);
+            for(i = 0; i < len; ++i)
+                handle_event(&evs[i]);
         }
-        usleep(10000);
     }
     ev_exit();
     return NULL;
@@ -381,6 +414,14 @@ void start_input_thread_wait(int wait_for_start)
         return;
     }
 
+    input_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(input_wake_fd < 0)
+    {
+        ERROR("input: failed to create eventfd: %s\n", strerror(errno));
+        pthread_mutex_unlock(&input_start_mutex);
+        return;
+    }
+
     input_run = 1;
     pthread_create(&input_thread, NULL, input_thread_work, NULL);
     if(wait_for_start)
@@ -397,8 +438,14 @@ void stop_input_thread(void)
         return;
     }
 
+    uint64_t val = 1;
     input_run = 0;
+    if(write(input_wake_fd, &val, sizeof(val)) < 0)
+        ERROR("input: failed to wake up the input thread: %s\n", strerror(errno));
     pthread_join(input_thread, NULL);
+
+    close(input_wake_fd);
+    input_wake_fd = -1;
     pthread_mutex_unlock(&input_start_mutex);
 }
 
@@ -690,6 +737,7 @@ static void keyaction_call_cur_act(struct keyaction_ctx *c, int action)
 static int keyaction_repeat_worker(uint32_t diff, void *data)
 {
     struct keyaction_ctx *c = data;
+    int res = WORKER_IDLE;
 
     pthread_mutex_lock(&c->lock);
     if(c->repeat != KEYACT_NONE)
@@ -701,10 +749,11 @@ static int keyaction_repeat_worker(uint32_t diff, void *data)
         }
         else
             c->repeat_timer -= diff;
+        res = WORKER_CONTINUE;
     }
     pthread_mutex_unlock(&c->lock);
 
-    return 0;
+    return res;
 }
 
 void keyaction_clear_active(void)
@@ -765,6 +814,7 @@ int keyaction_handle_keyevent(int key, int press)
         {
             keyaction_ctx.repeat = act;
             keyaction_ctx.repeat_timer = REPEAT_TIME_FIRST;
+            workers_wake();
         }
     }
 
@@ -122,7 +122,7 @@ static int keyboard_charset_switch_worker(UNUSED uint32_t diff, void *data)
     fb_request_draw();
 
     list_clear(&keyboard_bnt_data_old, free);
-    return 1;
+    return WORKER_REMOVE;
 }
 
 static void keyboard_btn_clicked(void *data)
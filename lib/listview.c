@@ -59,13 +59,13 @@ static int listview_bounceback(UNUSED uint32_t diff, void *data)
             v->overscroll_marks[0]->w = 0;
         if(v->overscroll_marks[1]->w != 0)
             v->overscroll_marks[1]->w = 0;
-        return 0;
+        return WORKER_IDLE;
     }
 
     if(v->touch.id == -1)
         listview_scroll_by(v, step);
 
-    return 0;
+    return WORKER_CONTINUE;
 }
 
 void listview_init_ui(listview *view)
@@ -125,6 +125,33 @@ listview_item *listview_add_item(listview *view, int id, void *data)
     return it;
 }
 
+void listview_rm_item(listview *view, listview_item *it)
+{
+    int idx;
+    for(idx = 0; view->items && view->items[idx]; ++idx)
+        if(view->items[idx] == it)
+            break;
+
+    if(!view->items || !view->items[idx])
+        return;
+
+    if(view->selected == it)
+        listview_select_item(view, NULL);
+
+    if(view->touch.hover == it)
+        view->touch.hover = NULL;
+
+    if(view->keyact_item_selected == idx)
+        view->keyact_item_selected = -1;
+    else if(view->keyact_item_selected > idx)
+        --view->keyact_item_selected;
+
+    list_rm_noreorder(&view->items, it, view->item_destroy);
+
+    if(!view->items)
+        keyaction_remove(listview_keyaction_call, view);
+}
+
 void listview_clear(listview *view)
 {
     if(listview_select_item(view, NULL))
@@ -192,8 +219,14 @@ void listview_update_ui_args(listview *view, int only_if_moved, int mutex_locked
 
     listview_enable_scroll(view, (int)(y > view->h));
     if(y > view->h)
+    {
         listview_update_scroll_mark(view);
 
+        // listview_bounceback is idle until the view gets overscrolled
+        if(view->pos < 0 || view->pos > y - view->h)
+            workers_wake();
+    }
+
     if(!mutex_locked)
         fb_batch_end();
     fb_request_draw();
@@ -379,6 +412,7 @@ void listview_scroll_by(listview *view, int y)
     else if(view->pos > (view->fullH - view->h) + OVERSCROLL_H)
         view->pos = (view->fullH - view->h) + OVERSCROLL_H;
 
+    fb_damage_rect(view->x, view->y, view->w, view->h);
     listview_select_item(view, NULL);
     listview_update_ui(view);
 }
@@ -395,6 +429,7 @@ void listview_scroll_to(listview *view, int pct)
     else if(view->pos > (view->fullH - view->h))
         view->pos = (view->fullH - view->h);
 
+    fb_damage_rect(view->x, view->y, view->w, view->h);
     listview_select_item(view, NULL);
     listview_update_ui(view);
 }
@@ -421,6 +456,8 @@ int listview_ensure_visible(listview *view, listview_item *it)
         view->pos = y;
     else
         return 0;
+
+    fb_damage_rect(view->x, view->y, view->w, view->h);
     return 1;
 }
 
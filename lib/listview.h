@@ -80,6 +80,7 @@ int listview_touch_handler(touch_event *ev, void *data);
 void listview_init_ui(listview *view);
 void listview_destroy(listview *view);
 listview_item *listview_add_item(listview *view, int id, void *data);
+void listview_rm_item(listview *view, listview_item *it);
 void listview_clear(listview *view);
 void listview_update_ui(listview *view);
 void listview_update_ui_args(listview *view, int only_if_moved, int mutex_locked);
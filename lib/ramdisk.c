@@ -0,0 +1,570 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "ramdisk.h"
+#include "log.h"
+#include "util.h"
+
+#define LZ4_LEGACY_MAGIC 0x184C2102
+#define LZ4_LEGACY_BLOCK (8 << 20)
+#define LZ4_MINMATCH 4
+#define LZ4_LASTLITERALS 5
+#define LZ4_MFLIMIT 12
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_LOG 16
+
+// Has to be at most LZ4_LEGACY_BLOCK
+#define RD_CHUNK_SIZE (1 << 20)
+#define RD_MAX_THREADS 8
+
+// deflate's window, each gzip chunk is primed with this much of the
+// previous one so that matches can reach across the boundary
+#define GZIP_DICT_SIZE (32 << 10)
+#define GZIP_HEADER_SIZE 10
+#define GZIP_TRAILER_SIZE 8
+
+struct rd_chunk
+{
+    uint8_t *data;
+    size_t size;
+    uint32_t crc;
+};
+
+struct rd_compress_job
+{
+    pthread_mutex_t mutex;
+    const uint8_t *data;
+    size_t size;
+    int type;
+    int level;
+    int chunks;
+    int next;
+    struct rd_chunk *out;
+};
+
+static inline uint32_t read_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void write_le32(uint8_t *p, uint32_t val)
+{
+    p[0] = val;
+    p[1] = val >> 8;
+    p[2] = val >> 16;
+    p[3] = val >> 24;
+}
+
+int rd_get_type(const uint8_t *data, size_t size)
+{
+    if(size >= 2 && data[0] == 0x1F && data[1] == 0x8B)
+        return RD_GZIP;
+    if(size >= 4 && read_le32(data) == LZ4_LEGACY_MAGIC)
+        return RD_LZ4;
+    return RD_UNKNOWN;
+}
+
+static uint8_t *gzip_decompress(const uint8_t *data, size_t size, size_t *out_size)
+{
+    z_stream strm;
+    uint8_t *res, *tmp;
+    size_t cap = size * 4 + 4096;
+    int ret;
+
+    memset(&strm, 0, sizeof(strm));
+    if(inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK)
+        return NULL;
+
+    res = malloc(cap);
+    strm.next_in = (Bytef*)data;
+    strm.avail_in = size;
+
+    while(1)
+    {
+        if(strm.total_out == cap)
+        {
+            cap *= 2;
+            tmp = realloc(res, cap);
+            if(!tmp)
+                goto fail;
+            res = tmp;
+        }
+
+        strm.next_out = res + strm.total_out;
+        strm.avail_out = cap - strm.total_out;
+
+        ret = inflate(&strm, Z_NO_FLUSH);
+        if(ret == Z_STREAM_END)
+        {
+            // Ramdisks may be several concatenated gzip members, and are
+            // often followed by zero padding.
+            if(strm.avail_in >= 2 && strm.next_in[0] == 0x1F && strm.next_in[1] == 0x8B)
+            {
+                uLong total_out = strm.total_out;
+                inflateReset(&strm);
+                strm.total_out = total_out;
+                continue;
+            }
+            break;
+        }
+        else if(ret != Z_OK && !(ret == Z_BUF_ERROR && strm.avail_out == 0))
+        {
+            ERROR("Failed to decompress gzip ramdisk: %d (%s)\n", ret, strm.msg ? strm.msg : "");
+            goto fail;
+        }
+    }
+
+    *out_size = strm.total_out;
+    inflateEnd(&strm);
+    return res;
+
+fail:
+    inflateEnd(&strm);
+    free(res);
+    return NULL;
+}
+
+// Compresses one piece of a single gzip member as raw deflate data. All
+// but the last piece end with a sync flush, i.e. on a byte boundary in the
+// middle of the stream, so the pieces can simply be concatenated.
+static int gzip_compress_chunk(const uint8_t *data, size_t size, const uint8_t *dict, size_t dict_size,
+        int last, int level, struct rd_chunk *out)
+{
+    z_stream strm;
+    size_t cap;
+
+    memset(&strm, 0, sizeof(strm));
+    if(deflateInit2(&strm, level > 0 ? level : Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+
+    if(dict_size && deflateSetDictionary(&strm, dict, dict_size) != Z_OK)
+    {
+        deflateEnd(&strm);
+        return -1;
+    }
+
+    // + the empty stored block of the sync flush
+    cap = deflateBound(&strm, size) + 16;
+    out->data = malloc(cap);
+
+    strm.next_in = (Bytef*)data;
+    strm.avail_in = size;
+    strm.next_out = out->data;
+    strm.avail_out = cap;
+
+    if(deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH) != (last ? Z_STREAM_END : Z_OK) ||
+        strm.avail_in != 0 || strm.avail_out == 0)
+    {
+        ERROR("Failed to compress gzip ramdisk!\n");
+        deflateEnd(&strm);
+        free(out->data);
+        out->data = NULL;
+        return -1;
+    }
+
+    out->size = strm.total_out;
+    out->crc = crc32(0, data, size);
+    deflateEnd(&strm);
+    return 0;
+}
+
+// Returns size of decompressed data or -1 on malformed block
+static ssize_t lz4_decompress_block(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap)
+{
+    const uint8_t *ip = src;
+    const uint8_t * const iend = src + src_len;
+    uint8_t *op = dst;
+    uint8_t * const oend = dst + dst_cap;
+    const uint8_t *match;
+    size_t len, offset;
+    uint8_t token, b;
+
+    while(ip < iend)
+    {
+        token = *ip++;
+
+        len = token >> 4;
+        if(len == 15)
+        {
+            do {
+                if(ip >= iend)
+                    return -1;
+                b = *ip++;
+                len += b;
+            } while(b == 255);
+        }
+
+        if(len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, len);
+        ip += len;
+        op += len;
+
+        // last sequence has only literals
+        if(ip == iend)
+            break;
+
+        if(iend - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > (size_t)(op - dst))
+            return -1;
+
+        len = token & 0x0F;
+        if(len == 15)
+        {
+            do {
+                if(ip >= iend)
+                    return -1;
+                b = *ip++;
+                len += b;
+            } while(b == 255);
+        }
+        len += LZ4_MINMATCH;
+
+        if(len > (size_t)(oend - op))
+            return -1;
+
+        // matches may overlap the output, copy bytewise
+        match = op - offset;
+        while(len--)
+            *op++ = *match++;
+    }
+    return op - dst;
+}
+
+static inline uint8_t *lz4_write_len(uint8_t *op, size_t len)
+{
+    while(len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+static uint8_t *lz4_write_sequence(uint8_t *op, const uint8_t *lit, size_t lit_len, size_t offset, size_t match_len)
+{
+    uint8_t *token = op++;
+
+    *token = (lit_len >= 15 ? 15 : lit_len) << 4;
+    if(lit_len >= 15)
+        op = lz4_write_len(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if(offset == 0)
+        return op;
+
+    *op++ = offset;
+    *op++ = offset >> 8;
+
+    *token |= match_len >= 15 ? 15 : match_len;
+    if(match_len >= 15)
+        op = lz4_write_len(op, match_len - 15);
+    return op;
+}
+
+static inline uint32_t lz4_hash(uint32_t seq)
+{
+    return (seq * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+// Greedy single-probe compressor, same approach as LZ4's fast mode.
+// After 1 << skip_shift misses in a row it starts skipping ahead faster,
+// lower values trade ratio for speed.
+// dst has to hold at least lz4_block_bound(len) bytes.
+static size_t lz4_compress_block(const uint8_t *src, size_t len, uint8_t *dst, uint32_t *table, int skip_shift)
+{
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t * const end = src + len;
+    const uint8_t * const mflimit = end - LZ4_MFLIMIT;
+    const uint8_t * const matchlimit = end - LZ4_LASTLITERALS;
+    const uint8_t *ref, *m, *r;
+    uint8_t *op = dst;
+    uint32_t seq, h;
+    int misses = 0;
+
+    memset(table, 0, sizeof(uint32_t) << LZ4_HASH_LOG);
+
+    if(len > LZ4_MFLIMIT)
+    {
+        while(ip < mflimit)
+        {
+            seq = read_le32(ip);
+            h = lz4_hash(seq);
+            ref = src + table[h];
+            table[h] = ip - src;
+
+            if(ref >= ip || ip - ref > LZ4_MAX_OFFSET || read_le32(ref) != seq)
+            {
+                // skip faster through incompressible data
+                ip += 1 + (misses++ >> skip_shift);
+                continue;
+            }
+
+            m = ip + LZ4_MINMATCH;
+            r = ref + LZ4_MINMATCH;
+            while(m < matchlimit && *m == *r)
+            {
+                ++m;
+                ++r;
+            }
+
+            op = lz4_write_sequence(op, anchor, ip - anchor, ip - ref, m - ip - LZ4_MINMATCH);
+            ip = anchor = m;
+            misses = 0;
+        }
+    }
+
+    op = lz4_write_sequence(op, anchor, end - anchor, 0, 0);
+    return op - dst;
+}
+
+static inline size_t lz4_block_bound(size_t len)
+{
+    return len + len/255 + 16;
+}
+
+static uint8_t *lz4_decompress(const uint8_t *data, size_t size, size_t *out_size)
+{
+    size_t pos = 4, len = 0, cap = 0;
+    uint8_t *res = NULL, *tmp;
+    uint32_t block_size;
+    ssize_t r;
+
+    while(size - pos >= 4)
+    {
+        block_size = read_le32(data + pos);
+        pos += 4;
+
+        // concatenated streams repeat the magic
+        if(block_size == LZ4_LEGACY_MAGIC)
+            continue;
+        if(block_size == 0)
+            break;
+        if(block_size > size - pos)
+        {
+            ERROR("lz4 block at %zu is truncated\n", pos - 4);
+            goto fail;
+        }
+
+        if(cap - len < LZ4_LEGACY_BLOCK)
+        {
+            cap = len + LZ4_LEGACY_BLOCK;
+            tmp = realloc(res, cap);
+            if(!tmp)
+                goto fail;
+            res = tmp;
+        }
+
+        r = lz4_decompress_block(data + pos, block_size, res + len, LZ4_LEGACY_BLOCK);
+        if(r < 0)
+        {
+            ERROR("lz4 block at %zu is corrupted\n", pos - 4);
+            goto fail;
+        }
+
+        len += r;
+        pos += block_size;
+    }
+
+    *out_size = len;
+    return res ? res : malloc(1);
+
+fail:
+    free(res);
+    return NULL;
+}
+
+// Writes one size-prefixed block of the legacy format
+static int lz4_compress_chunk(const uint8_t *data, size_t size, int level, struct rd_chunk *out)
+{
+    uint32_t *table = malloc(sizeof(uint32_t) << LZ4_HASH_LOG);
+    uint32_t block;
+
+    out->data = malloc(4 + lz4_block_bound(size));
+    block = lz4_compress_block(data, size, out->data + 4, table, level > 0 ? 3 + level : 6);
+    write_le32(out->data, block);
+    out->size = 4 + block;
+
+    free(table);
+    return 0;
+}
+
+uint8_t *rd_decompress(int type, const uint8_t *data, size_t size, size_t *out_size)
+{
+    switch(type)
+    {
+        case RD_GZIP:
+            return gzip_decompress(data, size, out_size);
+        case RD_LZ4:
+            return lz4_decompress(data, size, out_size);
+        default:
+            return NULL;
+    }
+}
+
+static void rd_compress_chunk(struct rd_compress_job *job, int idx)
+{
+    const size_t off = (size_t)idx * RD_CHUNK_SIZE;
+    const size_t len = imin(job->size - off, RD_CHUNK_SIZE);
+
+    switch(job->type)
+    {
+        case RD_GZIP:
+        {
+            const size_t dict = imin(off, GZIP_DICT_SIZE);
+            gzip_compress_chunk(job->data + off, len, job->data + off - dict, dict,
+                    idx == job->chunks - 1, job->level, &job->out[idx]);
+            break;
+        }
+        case RD_LZ4:
+            lz4_compress_chunk(job->data + off, len, job->level, &job->out[idx]);
+            break;
+    }
+}
+
+static void *rd_compress_thread(void *data)
+{
+    struct rd_compress_job *job = data;
+    int idx;
+
+    while(1)
+    {
+        pthread_mutex_lock(&job->mutex);
+        idx = job->next++;
+        pthread_mutex_unlock(&job->mutex);
+
+        if(idx >= job->chunks)
+            break;
+
+        rd_compress_chunk(job, idx);
+    }
+    return NULL;
+}
+
+// The input is split into RD_CHUNK_SIZE pieces which are compressed
+// independently on all cores. For lz4, each one becomes a separate block
+// of the legacy stream. For gzip, they are joined into a single member:
+// the kernel's initramfs unpacker stops after the first member unless it
+// ends exactly on a cpio entry boundary, which fixed-size pieces don't.
+uint8_t *rd_compress(int type, int level, const uint8_t *data, size_t size, size_t *out_size)
+{
+    struct rd_compress_job job;
+    pthread_t threads[RD_MAX_THREADS];
+    struct timespec start, end;
+    int i, thread_cnt, started = 0;
+    uint8_t *res = NULL, *itr;
+    size_t len = 0;
+    uint32_t ms, crc = 0;
+
+    if(type != RD_GZIP && type != RD_LZ4)
+        return NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    memset(&job, 0, sizeof(job));
+    pthread_mutex_init(&job.mutex, NULL);
+    job.data = data;
+    job.size = size;
+    job.type = type;
+    job.level = level;
+    job.chunks = imax(1, (size + RD_CHUNK_SIZE - 1) / RD_CHUNK_SIZE);
+    job.out = mzalloc(job.chunks * sizeof(struct rd_chunk));
+
+    thread_cnt = imin(sysconf(_SC_NPROCESSORS_ONLN), RD_MAX_THREADS);
+    thread_cnt = imax(1, imin(thread_cnt, job.chunks));
+
+    // this thread does its share of the work as well
+    for(i = 0; i < thread_cnt - 1; ++i)
+    {
+        if(pthread_create(&threads[i], NULL, rd_compress_thread, &job) != 0)
+            break;
+        ++started;
+    }
+    rd_compress_thread(&job);
+    for(i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    for(i = 0; i < job.chunks; ++i)
+    {
+        if(!job.out[i].data)
+            goto exit;
+        len += job.out[i].size;
+    }
+
+    if(type == RD_LZ4)
+        len += 4;
+    else
+        len += GZIP_HEADER_SIZE + GZIP_TRAILER_SIZE;
+
+    res = malloc(len);
+    itr = res;
+    if(type == RD_LZ4)
+    {
+        write_le32(itr, LZ4_LEGACY_MAGIC);
+        itr += 4;
+    }
+    else
+    {
+        // deflate, no flags, no mtime, unix
+        static const uint8_t gzip_header[GZIP_HEADER_SIZE] = { 0x1F, 0x8B, 0x08, 0, 0, 0, 0, 0, 0, 0x03 };
+        memcpy(itr, gzip_header, GZIP_HEADER_SIZE);
+        itr += GZIP_HEADER_SIZE;
+    }
+
+    for(i = 0; i < job.chunks; ++i)
+    {
+        memcpy(itr, job.out[i].data, job.out[i].size);
+        itr += job.out[i].size;
+        if(i == 0)
+            crc = job.out[i].crc;
+        else
+            crc = crc32_combine(crc, job.out[i].crc, imin(size - (size_t)i*RD_CHUNK_SIZE, RD_CHUNK_SIZE));
+    }
+
+    if(type == RD_GZIP)
+    {
+        write_le32(itr, crc);
+        write_le32(itr + 4, (uint32_t)size);
+    }
+    *out_size = len;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ms = imax(1, timespec_diff(&start, &end));
+    INFO("Compressed ramdisk %zu -> %zu bytes in %u ms (%u KiB/s, level %d, %d threads)\n",
+            size, len, ms, (uint32_t)((uint64_t)size * 1000 / 1024 / ms), level, started + 1);
+
+exit:
+    for(i = 0; i < job.chunks; ++i)
+        free(job.out[i].data);
+    free(job.out);
+    pthread_mutex_destroy(&job.mutex);
+    return res;
+}
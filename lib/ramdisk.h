@@ -0,0 +1,37 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define RD_UNKNOWN 0
+#define RD_GZIP    1
+#define RD_LZ4     2 // lz4 "legacy" frames, the format the kernel unpacks
+
+int rd_get_type(const uint8_t *data, size_t size);
+
+#define RD_LEVEL_DEFAULT 0
+
+// Both return malloc'ed buffer or NULL on failure. level goes from
+// 1 (fastest) to 9 (smallest), or RD_LEVEL_DEFAULT.
+uint8_t *rd_decompress(int type, const uint8_t *data, size_t size, size_t *out_size);
+uint8_t *rd_compress(int type, int level, const uint8_t *data, size_t size, size_t *out_size);
+
+#endif
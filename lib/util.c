@@ -34,6 +34,8 @@
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/inotify.h>
+#include <sys/poll.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/wait.h>
@@ -45,6 +47,27 @@
 
 #include <private/android_filesystem_config.h>
 
+// Not in older kernel headers
+#ifndef LOOP_CTL_GET_FREE
+#define LOOP_CTL_GET_FREE 0x4C82
+#endif
+
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#define LO_FLAGS_DIRECT_IO 16
+#endif
+
+#ifndef LOOP_CONFIGURE
+#define LOOP_CONFIGURE 0x4C0A
+struct loop_config
+{
+    uint32_t fd;
+    uint32_t block_size;
+    struct loop_info64 info;
+    uint64_t __reserved[8];
+};
+#endif
+
 #include "log.h"
 #include "util.h"
 #include "mrom_data.h"
@@ -256,15 +279,110 @@ void remove_link(const char *oldpath, const char *newpath)
 }
 
 int wait_for_file(const char *filename, int timeout)
+{
+    const char *files[] = { filename, NULL };
+    return wait_for_files(files, timeout*1000);
+}
+
+static int64_t monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+// Returns 1 if all of the files exist
+static int files_exist(const char * const *files)
 {
     struct stat info;
-    time_t timeout_time = gettime() + timeout;
-    int ret = -1;
+    for(; *files; ++files)
+        if(stat(*files, &info) < 0)
+            return 0;
+    return 1;
+}
 
-    while (gettime() < timeout_time && ((ret = stat(filename, &info)) < 0))
-        usleep(10000);
+// Watches the closest existing parent of path for new entries. The
+// parent can change while we're adding the watch (e.g. /dev/block/platform
+// appearing), so repeat until it is stable.
+static void watch_closest_parent(int in_fd, const char *path)
+{
+    char dir[PATH_MAX];
+    char prev[PATH_MAX] = { 0 };
+    char *slash;
+    struct stat info;
 
-    return ret;
+    while(1)
+    {
+        snprintf(dir, sizeof(dir), "%s", path);
+        do
+        {
+            slash = strrchr(dir, '/');
+            if(!slash)
+                return;
+            if(slash == dir)
+                slash[1] = 0;
+            else
+                *slash = 0;
+        } while(stat(dir, &info) < 0 && slash != dir);
+
+        if(strcmp(dir, prev) == 0)
+            return;
+
+        inotify_add_watch(in_fd, dir, IN_CREATE | IN_MOVED_TO | IN_ATTRIB);
+        strcpy(prev, dir);
+    }
+}
+
+// poll() timeout, in case some watch was missed anyway
+#define WAIT_FILES_RECHECK_MS 100
+
+int wait_for_files(const char * const *files, int timeout_ms)
+{
+    const char * const *itr;
+    const int64_t deadline = monotonic_ms() + timeout_ms;
+    int64_t remaining;
+    char buf[4096];
+    struct pollfd pfd;
+    int res = -1;
+
+    if(files_exist(files))
+        return 0;
+
+    pfd.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    pfd.events = POLLIN;
+    if(pfd.fd < 0)
+        ERROR("wait_for_files: inotify_init1 failed (%s), polling instead\n", strerror(errno));
+
+    while((remaining = deadline - monotonic_ms()) > 0)
+    {
+        if(pfd.fd >= 0)
+        {
+            for(itr = files; *itr; ++itr)
+                watch_closest_parent(pfd.fd, *itr);
+        }
+
+        // check after the watches are set, to not miss anything created in between
+        if(files_exist(files))
+        {
+            res = 0;
+            break;
+        }
+
+        if(pfd.fd >= 0)
+        {
+            if(poll(&pfd, 1, imin(remaining, WAIT_FILES_RECHECK_MS)) > 0)
+                while(read(pfd.fd, buf, sizeof(buf)) > 0);
+        }
+        else
+            usleep(imin(remaining, 10)*1000);
+    }
+
+    if(res != 0 && files_exist(files))
+        res = 0;
+
+    if(pfd.fd >= 0)
+        close(pfd.fd);
+    return res;
 }
 
 int copy_file(const char *from, const char *to)
@@ -294,6 +412,68 @@ int copy_file(const char *from, const char *to)
     return 0;
 }
 
+void *read_whole_file(const char *path, size_t *size)
+{
+    struct stat info;
+    uint8_t *data = NULL;
+    size_t done = 0;
+    ssize_t r;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return NULL;
+
+    if(fstat(fd, &info) < 0)
+        goto exit;
+
+    data = malloc(info.st_size ? info.st_size : 1);
+    while(done < (size_t)info.st_size)
+    {
+        r = read(fd, data + done, info.st_size - done);
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r <= 0)
+        {
+            free(data);
+            data = NULL;
+            goto exit;
+        }
+        done += r;
+    }
+    *size = done;
+
+exit:
+    close(fd);
+    return data;
+}
+
+int write_whole_file(const char *path, const void *data, size_t size)
+{
+    const uint8_t *itr = data;
+    ssize_t r;
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+        return -1;
+
+    while(size > 0)
+    {
+        r = write(fd, itr, size);
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r <= 0)
+        {
+            close(fd);
+            return -1;
+        }
+        itr += r;
+        size -= r;
+    }
+    return close(fd);
+}
+
 int write_file(const char *path, const char *value)
 {
     int fd, ret, len;
@@ -714,6 +894,36 @@ int strendswith(const char *haystack, const char *needle)
     return strncmp(haystack + h_len - n_len, needle, n_len) == 0;
 }
 
+// Binds file_fd to the loop device. Direct I/O keeps the image's pages
+// from being cached twice, once for the loop device and once for the file.
+static int loop_set_file(int device_fd, int file_fd)
+{
+    static int has_loop_configure = 1;
+    struct loop_config config;
+
+    // LOOP_CONFIGURE (Linux 5.8) does both in one ioctl
+    if(has_loop_configure)
+    {
+        memset(&config, 0, sizeof(config));
+        config.fd = file_fd;
+        config.info.lo_flags = LO_FLAGS_DIRECT_IO;
+        if(ioctl(device_fd, LOOP_CONFIGURE, &config) == 0)
+            return 0;
+
+        if(errno != EINVAL && errno != ENOTTY)
+            return -1;
+        has_loop_configure = 0;
+    }
+
+    if(ioctl(device_fd, LOOP_SET_FD, file_fd) < 0)
+        return -1;
+
+    // Kernels before 4.4 and FUSE-backed images can't do direct I/O,
+    // the loop then just stays buffered.
+    ioctl(device_fd, LOOP_SET_DIRECT_IO, 1);
+    return 0;
+}
+
 int create_loop_device(const char *dev_path, const char *img_path, int loop_num, int loop_chmod)
 {
     int file_fd, device_fd, res = -1;
@@ -744,9 +954,9 @@ int create_loop_device(const char *dev_path, const char *img_path, int loop_num,
         goto close_file;
     }
 
-    if (ioctl(device_fd, LOOP_SET_FD, file_fd) < 0)
+    if (loop_set_file(device_fd, file_fd) < 0)
     {
-        ERROR("ioctl LOOP_SET_FD failed on %s (%d: %s)\n", dev_path, errno, strerror(errno));
+        ERROR("Failed to set loop file on %s (%d: %s)\n", dev_path, errno, strerror(errno));
         goto close_dev;
     }
 
@@ -759,22 +969,33 @@ close_file:
 }
 
 #define MAX_LOOP_NUM 1023
-int mount_image(const char *src, const char *dst, const char *fs, int flags, const void *data)
+#define LOOP_CONTROL_PATH "/dev/loop-control"
+
+// Returns number of an unused loop device >= start_num, or -1.
+static int find_free_loop(int start_num)
 {
     char path[64];
-    int device_fd;
-    int loop_num = 0;
-    int res = -1;
+    int device_fd, loop_num;
     struct stat info;
     struct loop_info64 lo_info;
 
-    for(; loop_num < MAX_LOOP_NUM; ++loop_num)
+    // The kernel knows the lowest free one, and creates it if needed
+    if(start_num == 0 && (device_fd = open(LOOP_CONTROL_PATH, O_RDWR | O_CLOEXEC)) >= 0)
+    {
+        loop_num = ioctl(device_fd, LOOP_CTL_GET_FREE);
+        close(device_fd);
+
+        if(loop_num >= 0 && loop_num < MAX_LOOP_NUM)
+            return loop_num;
+    }
+
+    for(loop_num = start_num; loop_num < MAX_LOOP_NUM; ++loop_num)
     {
         sprintf(path, "/dev/block/loop%d", loop_num);
         if(stat(path, &info) < 0)
         {
             if(errno == ENOENT)
-                break;
+                return loop_num;
         }
         else if(S_ISBLK(info.st_mode) && (device_fd = open(path, O_RDWR | O_CLOEXEC)) >= 0)
         {
@@ -782,16 +1003,26 @@ int mount_image(const char *src, const char *dst, const char *fs, int flags, con
             close(device_fd);
 
             if (ioctl_res < 0 && errno == ENXIO)
-                break;
+                return loop_num;
         }
     }
+    return -1;
+}
 
-    if(loop_num == MAX_LOOP_NUM)
+int mount_image(const char *src, const char *dst, const char *fs, int flags, const void *data)
+{
+    char path[64];
+    int loop_num;
+    int res = -1;
+
+    loop_num = find_free_loop(0);
+    if(loop_num < 0)
     {
         ERROR("mount_image: failed to find suitable loop device number!\n");
         return -1;
     }
 
+    sprintf(path, "/dev/block/loop%d", loop_num);
     if(create_loop_device(path, src, loop_num, 0777) < 0)
         return -1;
 
@@ -809,31 +1040,12 @@ int multirom_mount_image(const char *src, const char *dst, const char *fs, int f
 {
     static int next_loop_num = MULTIROM_LOOP_NUM_START;
     char path[64];
-    int device_fd;
-    int loop_num = 0;
+    int loop_num;
     int res = -1;
-    struct stat info;
-    struct loop_info64 lo_info;
-
-    for(loop_num = next_loop_num; loop_num < MAX_LOOP_NUM; ++loop_num)
-    {
-        sprintf(path, "/dev/block/loop%d", loop_num);
-        if(stat(path, &info) < 0)
-        {
-            if(errno == ENOENT)
-                break;
-        }
-        else if(S_ISBLK(info.st_mode) && (device_fd = open(path, O_RDWR | O_CLOEXEC)) >= 0)
-        {
-            int ioctl_res = ioctl(device_fd, LOOP_GET_STATUS64, &lo_info);
-            close(device_fd);
-
-            if (ioctl_res < 0 && errno == ENXIO)
-                break;
-        }
-    }
 
-    if(loop_num == MAX_LOOP_NUM)
+    // Stays above the loops the ROM itself will want, so no loop-control here
+    loop_num = find_free_loop(next_loop_num);
+    if(loop_num < 0)
     {
         ERROR("mount_image: failed to find suitable loop device number!\n");
         return -1;
@@ -39,7 +39,10 @@ void sanitize(char *p);
 int make_link(const char *oldpath, const char *newpath);
 void remove_link(const char *oldpath, const char *newpath);
 int wait_for_file(const char *filename, int timeout);
+int wait_for_files(const char * const *files, int timeout_ms); // NULL-terminated, 0 when all exist
 int copy_file(const char *from, const char *to);
+void *read_whole_file(const char *path, size_t *size); // malloc'ed
+int write_whole_file(const char *path, const void *data, size_t size);
 int copy_dir(const char *from, const char *to);
 int mkdir_with_perms(const char *path, mode_t mode, const char *owner, const char *group);
 int write_file(const char *path, const char *value);
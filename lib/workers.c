@@ -28,20 +28,30 @@ struct worker
 {
     void *data;
     worker_call call;
+    int idle;
 };
 
 struct worker_thread
 {
     pthread_t thread;
     pthread_mutex_t mutex;
-    struct worker **workers;
+    list_buf workers;
     volatile int run;
+
+    // wake_seq is bumped by workers_wake(). It has its own mutex so that
+    // workers can wake the thread from inside their calls.
+    pthread_mutex_t wake_mutex;
+    pthread_cond_t wake_cond;
+    uint32_t wake_seq;
 };
 
 static struct worker_thread worker_thread = {
     .mutex = PTHREAD_MUTEX_INITIALIZER,
-    .workers = NULL,
+    .workers = { NULL, 0, 0 },
     .run = 0,
+    .wake_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .wake_cond = PTHREAD_COND_INITIALIZER,
+    .wake_seq = 0,
 };
 
 #define SLEEP_CONST 10
@@ -49,6 +59,8 @@ static void *worker_thread_work(void *data)
 {
     struct worker_thread *t = (struct worker_thread*)data;
     struct worker **w;
+    int active;
+    uint32_t seq, seen_seq = 0;
 
     struct timespec last, curr;
     uint32_t diff = 0, prev_sleep = 0;
@@ -56,21 +68,59 @@ static void *worker_thread_work(void *data)
 
     while(t->run)
     {
+        pthread_mutex_lock(&t->wake_mutex);
+        seq = t->wake_seq;
+        pthread_mutex_unlock(&t->wake_mutex);
+
         pthread_mutex_lock(&t->mutex);
 
         clock_gettime(CLOCK_MONOTONIC, &curr);
         diff = timespec_diff(&last, &curr);
 
-        for(w = t->workers; w && *w;)
+        active = 0;
+        for(w = (struct worker**)t->workers.items; w && *w;)
         {
-            if((*w)->call(diff, (*w)->data))
-                w = list_rm_at(&worker_thread.workers, w - t->workers, &free);
-            else
+            if(seq != seen_seq)
+                (*w)->idle = 0;
+
+            if((*w)->idle)
+            {
                 ++w;
+                continue;
+            }
+
+            switch((*w)->call(diff, (*w)->data))
+            {
+                case WORKER_REMOVE:
+                    w = list_buf_rm_at(&t->workers, w - (struct worker**)t->workers.items, &free);
+                    break;
+                case WORKER_IDLE:
+                    (*w)->idle = 1;
+                    ++w;
+                    break;
+                default:
+                    ++active;
+                    ++w;
+                    break;
+            }
         }
+        seen_seq = seq;
 
         pthread_mutex_unlock(&t->mutex);
 
+        if(active == 0)
+        {
+            // Nothing needs ticks, sleep until workers_add() or workers_wake()
+            pthread_mutex_lock(&t->wake_mutex);
+            while(t->run && t->wake_seq == seq)
+                pthread_cond_wait(&t->wake_cond, &t->wake_mutex);
+            pthread_mutex_unlock(&t->wake_mutex);
+
+            clock_gettime(CLOCK_MONOTONIC, &last);
+            prev_sleep = 0;
+            continue;
+        }
+
         last = curr;
         if(diff <= SLEEP_CONST+prev_sleep)
         {
@@ -98,9 +148,10 @@ void workers_stop(void)
         return;
 
     worker_thread.run = 0;
+    workers_wake();
     pthread_join(worker_thread.thread, NULL);
 
-    list_clear(&worker_thread.workers, &free);
+    list_buf_clear(&worker_thread.workers, &free);
 }
 
 void workers_add(worker_call call, void *data)
@@ -116,8 +167,18 @@ void workers_add(worker_call call, void *data)
     w->data = data;
 
     pthread_mutex_lock(&worker_thread.mutex);
-    list_add(&worker_thread.workers, w);
+    list_buf_add(&worker_thread.workers, w);
     pthread_mutex_unlock(&worker_thread.mutex);
+
+    workers_wake();
+}
+
+void workers_wake(void)
+{
+    pthread_mutex_lock(&worker_thread.wake_mutex);
+    ++worker_thread.wake_seq;
+    pthread_cond_signal(&worker_thread.wake_cond);
+    pthread_mutex_unlock(&worker_thread.wake_mutex);
 }
 
 void workers_remove(worker_call call, void *data)
@@ -129,18 +190,15 @@ void workers_remove(worker_call call, void *data)
     }
 
     pthread_mutex_lock(&worker_thread.mutex);
-    if(worker_thread.workers)
+    int i;
+    struct worker *w;
+    for(i = 0; i < worker_thread.workers.len; ++i)
     {
-        int i;
-        struct worker *w;
-        for(i = 0; worker_thread.workers[i]; ++i)
+        w = worker_thread.workers.items[i];
+        if(w->call == call && w->data == data)
         {
-            w = worker_thread.workers[i];
-            if(w->call == call && w->data == data)
-            {
-                list_rm_at(&worker_thread.workers, i, &free);
-                break;
-            }
+            list_buf_rm_at(&worker_thread.workers, i, &free);
+            break;
         }
     }
     pthread_mutex_unlock(&worker_thread.mutex);
@@ -21,12 +21,20 @@
 #include <stdint.h>
 #include <pthread.h>
 
-typedef int (*worker_call)(uint32_t, void *); // ms_diff, data. Returns 1 if it should be removed
+enum
+{
+    WORKER_CONTINUE = 0, // call it again on the next tick
+    WORKER_REMOVE   = 1, // remove the worker
+    WORKER_IDLE     = 2, // keep the worker, but don't tick it until workers_wake()
+};
+
+typedef int (*worker_call)(uint32_t, void *); // ms_diff, data. Returns one of WORKER_*
 
 void workers_start(void);
 void workers_stop(void);
 void workers_add(worker_call call, void *data);
 void workers_remove(worker_call call, void *data);
+void workers_wake(void);
 pthread_t workers_get_thread_id(void);
 
 #endif
@@ -28,6 +28,7 @@
 #include "multirom.h"
 #include "lib/framebuffer.h"
 #include "lib/log.h"
+#include "lib/containers.h"
 #include "version.h"
 #include "lib/util.h"
 #include "lib/mrom_data.h"
@@ -116,6 +117,10 @@ int main(int argc, const char *argv[])
 
     ERROR("Running MultiROM v%d%s\n", VERSION_MULTIROM, VERSION_DEV_FIX);
 
+#ifdef MR_CONTAINERS_BENCHMARK
+    containers_benchmark();
+#endif
+
     // root is mounted read only in android and MultiROM uses
     // it to store some temp files, so remount it.
     // Yes, there is better solution to this.
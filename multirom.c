@@ -29,9 +29,13 @@
 #include <sys/klog.h>
 #include <sys/vfs.h>
 #include <sys/statvfs.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <linux/loop.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <zlib.h>
+#include <cutils/uevent.h>
 
 // clone libbootimg to /system/extras/ from
 // https://github.com/Tasssadar/libbootimg.git
@@ -43,6 +47,7 @@
 
 #include "lib/containers.h"
 #include "lib/framebuffer.h"
+#include "lib/fs_probe.h"
 #include "lib/inject.h"
 #include "lib/input.h"
 #include "lib/log.h"
@@ -74,9 +79,16 @@ static char exfat_path[64] = { 0 };
 static char partition_dir[64] = { 0 };
 static char datamedia_dir[64] = { 0 };
 
+#define USB_UEVENT_SOCKET_SIZE (64*1024)
+#define USB_UEVENT_MSG_SIZE 2048
+#define USB_NODE_TIMEOUT_MS 1000
+#define USB_NAME_MAX 64
+
 static volatile int run_usb_refresh = 0;
 static pthread_t usb_refresh_thread;
+static int usb_refresh_wake_fd = -1; // eventfd, manual refresh and thread stop
 static pthread_mutex_t parts_mutex = PTHREAD_MUTEX_INITIALIZER;
+static list_buf usb_events = { NULL, 0, 0 }; // struct usb_event, under parts_mutex
 static void (*usb_refresh_handler)(void) = NULL;
 
 char* read_file(char* file) {
@@ -613,6 +625,8 @@ static int compare_rom_names(const void *a, const void *b)
     return 0;
 }
 
+static int multirom_scan_roms_dir(struct multirom_status *s, const char *roms_path, struct usb_partition *part);
+
 int multirom_apk_get_roms(struct multirom_status *s)
 {
     if(multirom_find_base_dir() == -1)
@@ -674,63 +688,11 @@ int multirom_apk_get_roms(struct multirom_status *s)
 
     /* Get Internal Storage ROMs */
     sprintf(roms_path, "%s/roms", mrom_dir());
-    d = opendir(roms_path);
-    if(!d)
+    if(multirom_scan_roms_dir(s, roms_path, NULL) < 0)
     {
         printf("Failed to open roms dir!\n");
         //return -1;
     }
-    else
-    {
-        struct dirent *dr;
-        char path[256];
-        struct multirom_rom **add_roms = NULL;
-        while((dr = readdir(d)))
-        {
-            if(dr->d_name[0] == '.')
-                continue;
-
-            if(dr->d_type != DT_DIR)
-                continue;
-
-            if(strlen(dr->d_name) > MAX_ROM_NAME_LEN)
-            {
-                printf("Skipping ROM %s, name is too long (max %d chars allowed)\n", dr->d_name, MAX_ROM_NAME_LEN);
-                continue;
-            }
-
-            //printf("Adding ROM %s\n", dr->d_name);
-
-            struct multirom_rom *rom = malloc(sizeof(struct multirom_rom));
-            memset(rom, 0, sizeof(struct multirom_rom));
-
-            rom->id = multirom_generate_rom_id();
-            rom->name = strdup(dr->d_name);
-
-            snprintf(path, sizeof(path), "%s/%s", roms_path, rom->name);
-            rom->base_path = strdup(path);
-
-            rom->type = multirom_get_rom_type(rom);
-
-            snprintf(path, sizeof(path), "%s/boot.img", rom->base_path);
-            rom->has_bootimg = access(path, R_OK) == 0 ? 1 : 0;
-
-            multirom_find_rom_icon(rom);
-
-            list_add(&add_roms, rom);
-        }
-
-        closedir(d);
-
-        if(add_roms)
-        {
-            // sort roms
-            qsort(add_roms, list_item_count(add_roms), sizeof(struct multirom_rom*), compare_rom_names);
-
-            // add them to main list
-            list_swap(&add_roms, &s->roms);
-        }
-    }
 
     /* Get External ROMs */
     multirom_update_partitions(s);
@@ -784,62 +746,12 @@ int multirom_default_status(struct multirom_status *s)
         closedir(d);
 
     sprintf(roms_path, "%s/roms", mrom_dir());
-    d = opendir(roms_path);
-    if(!d)
+    if(multirom_scan_roms_dir(s, roms_path, NULL) < 0)
     {
         ERROR("Failed to open roms dir!\n");
         return -1;
     }
 
-    struct dirent *dr;
-    char path[256];
-    struct multirom_rom **add_roms = NULL;
-    while((dr = readdir(d)))
-    {
-        if(dr->d_name[0] == '.')
-            continue;
-
-        if(dr->d_type != DT_DIR)
-            continue;
-
-        if(strlen(dr->d_name) > MAX_ROM_NAME_LEN)
-        {
-            ERROR("Skipping ROM %s, name is too long (max %d chars allowed)\n", dr->d_name, MAX_ROM_NAME_LEN);
-            continue;
-        }
-
-        INFO("Adding ROM %s\n", dr->d_name);
-
-        struct multirom_rom *rom = malloc(sizeof(struct multirom_rom));
-        memset(rom, 0, sizeof(struct multirom_rom));
-
-        rom->id = multirom_generate_rom_id();
-        rom->name = strdup(dr->d_name);
-
-        snprintf(path, sizeof(path), "%s/%s", roms_path, rom->name);
-        rom->base_path = strdup(path);
-
-        rom->type = multirom_get_rom_type(rom);
-
-        snprintf(path, sizeof(path), "%s/boot.img", rom->base_path);
-        rom->has_bootimg = access(path, R_OK) == 0 ? 1 : 0;
-
-        multirom_find_rom_icon(rom);
-
-        list_add(&add_roms, rom);
-    }
-
-    closedir(d);
-
-    if(add_roms)
-    {
-        // sort roms
-        qsort(add_roms, list_item_count(add_roms), sizeof(struct multirom_rom*), compare_rom_names);
-
-        // add them to main list
-        list_swap(&add_roms, &s->roms);
-    }
-
     s->current_rom = multirom_get_internal(s);
     if(!s->current_rom)
     {
@@ -1118,9 +1030,6 @@ void multirom_find_usb_roms(struct multirom_status *s)
 int multirom_scan_partition_for_roms(struct multirom_status *s, struct usb_partition *p)
 {
     char path[256];
-    int i;
-    struct dirent *dr;
-    struct multirom_rom **add_roms = NULL;
 
 #ifdef MR_MOVE_USB_DIR
     // groupers will have old "multirom" folder on USB drive instead of "multirom-grouper".
@@ -1148,60 +1057,88 @@ int multirom_scan_partition_for_roms(struct multirom_status *s, struct usb_parti
 #endif
 
     sprintf(path, "%s/multirom-"TARGET_DEVICE, p->mount_path);
-    if(access(path, F_OK) < 0)
-        return -1;
+    return multirom_scan_roms_dir(s, path, p);
+}
 
-    DIR *d = opendir(path);
-    if(!d)
+int multirom_path_exists(char *base, char *filename)
+{
+    char path[256];
+    sprintf(path, "%s/%s", base, filename);
+    if(access(path, R_OK) < 0)
         return -1;
+    return 0;
+}
 
-    while((dr = readdir(d)) != NULL)
-    {
-        if(dr->d_name[0] == '.')
-            continue;
-
-        struct multirom_rom *rom = malloc(sizeof(struct multirom_rom));
-        memset(rom, 0, sizeof(struct multirom_rom));
-
-        rom->id = multirom_generate_rom_id();
-        rom->name = strdup(dr->d_name);
-
-        sprintf(path, "%s/multirom-"TARGET_DEVICE"/%s", p->mount_path, rom->name);
-        rom->base_path = strdup(path);
-
-        rom->partition = p;
-        rom->type = multirom_get_rom_type(rom);
+enum
+{
+    RF_BOOT              = (1 << 0),
+    RF_SYSTEM            = (1 << 1),
+    RF_DATA              = (1 << 2),
+    RF_CACHE             = (1 << 3),
+    RF_SYSTEM_IMG        = (1 << 4),
+    RF_DATA_IMG          = (1 << 5),
+    RF_CACHE_IMG         = (1 << 6),
+    RF_SYSTEM_SPARSE_IMG = (1 << 7),
+    RF_DATA_SPARSE_IMG   = (1 << 8),
+    RF_CACHE_SPARSE_IMG  = (1 << 9),
+    RF_ROM_INFO          = (1 << 10),
+    RF_ROOT              = (1 << 11),
+    RF_ROOT_IMG          = (1 << 12),
+    RF_BOOT_IMG          = (1 << 13),
+};
 
-        sprintf(path, "%s/boot.img", rom->base_path);
-        rom->has_bootimg = access(path, R_OK) == 0 ? 1 : 0;
+static const struct
+{
+    const char *name;
+    uint32_t flag;
+} rom_files[] = {
+    { "boot",               RF_BOOT },
+    { "system",             RF_SYSTEM },
+    { "data",               RF_DATA },
+    { "cache",              RF_CACHE },
+    { "system.img",         RF_SYSTEM_IMG },
+    { "data.img",           RF_DATA_IMG },
+    { "cache.img",          RF_CACHE_IMG },
+    { "system.sparse.img",  RF_SYSTEM_SPARSE_IMG },
+    { "data.sparse.img",    RF_DATA_SPARSE_IMG },
+    { "cache.sparse.img",   RF_CACHE_SPARSE_IMG },
+    { "rom_info.txt",       RF_ROM_INFO },
+    { "root",               RF_ROOT },
+    { "root.img",           RF_ROOT_IMG },
+    { "boot.img",           RF_BOOT_IMG },
+};
 
-        multirom_find_rom_icon(rom);
+// Lists the ROM's folder once and returns RF_* of the files it has.
+// Much cheaper than access() for each name on FUSE-mounted USB drives.
+static uint32_t multirom_get_rom_files(const char *base_path)
+{
+    uint32_t res = 0;
+    struct dirent *dr;
+    size_t i;
+    DIR *d;
 
-        list_add(&add_roms, rom);
-    }
-    closedir(d);
+    d = opendir(base_path);
+    if(!d)
+        return 0;
 
-    if(add_roms)
+    while((dr = readdir(d)))
     {
-        // sort roms
-        qsort(add_roms, list_item_count(add_roms), sizeof(struct multirom_rom*), compare_rom_names);
-
-        list_add_from_list(&s->roms, add_roms);
-        list_clear(&add_roms, NULL);
+        for(i = 0; i < ARRAY_SIZE(rom_files); ++i)
+        {
+            if(strcmp(dr->d_name, rom_files[i].name) == 0)
+            {
+                res |= rom_files[i].flag;
+                break;
+            }
+        }
     }
-    return 0;
+    closedir(d);
+    return res;
 }
 
-int multirom_path_exists(char *base, char *filename)
-{
-    char path[256];
-    sprintf(path, "%s/%s", base, filename);
-    if(access(path, R_OK) < 0)
-        return -1;
-    return 0;
-}
+#define HAS_FILES(f) ((files & (f)) == (f))
 
-int multirom_get_rom_type(struct multirom_rom *rom)
+static int multirom_get_rom_type_from_files(struct multirom_rom *rom, uint32_t files)
 {
     if(!rom->partition && strcmp(rom->name, INTERNAL_ROM_NAME) == 0)
         return ROM_DEFAULT;
@@ -1209,30 +1146,28 @@ int multirom_get_rom_type(struct multirom_rom *rom)
     char *b = rom->base_path;
 
     // Handle android ROMs
-    if(!multirom_path_exists(b, "boot"))
+    if(HAS_FILES(RF_BOOT))
     {
-        if(!multirom_path_exists(b, "system") && !multirom_path_exists(b, "data") &&
-            !multirom_path_exists(b, "cache"))
+        if(HAS_FILES(RF_SYSTEM | RF_DATA | RF_CACHE))
         {
             if(!rom->partition) return ROM_ANDROID_INTERNAL;
             else                return ROM_ANDROID_USB_DIR;
         }
-        else if(!multirom_path_exists(b, "system.sparse.img") &&
-                (!multirom_path_exists(b, "data") || !multirom_path_exists(b, "data.sparse.img")) &&
-                (!multirom_path_exists(b, "cache") || !multirom_path_exists(b, "cache.sparse.img")))
+        else if(HAS_FILES(RF_SYSTEM_SPARSE_IMG) &&
+                (files & (RF_DATA | RF_DATA_SPARSE_IMG)) &&
+                (files & (RF_CACHE | RF_CACHE_SPARSE_IMG)))
         {
             if(!rom->partition) return ROM_ANDROID_INTERNAL_HYBRID;
             else                return ROM_ANDROID_USB_HYBRID;
         }
-        else if(!multirom_path_exists(b, "system.img") && !multirom_path_exists(b, "data.img") &&
-                !multirom_path_exists(b, "cache.img"))
+        else if(HAS_FILES(RF_SYSTEM_IMG | RF_DATA_IMG | RF_CACHE_IMG))
         {
             return ROM_ANDROID_USB_IMG;
         }
     }
 
     // handle linux ROMs
-    if(!multirom_path_exists(b, "rom_info.txt"))
+    if(HAS_FILES(RF_ROM_INFO))
     {
         if(!rom->partition)
             return ROM_LINUX_INTERNAL;
@@ -1241,8 +1176,8 @@ int multirom_get_rom_type(struct multirom_rom *rom)
     }
 
     // Handle Ubuntu 13.04 - deprecated
-    if ((!multirom_path_exists(b, "root") && multirom_path_exists(b, "boot.img")) ||
-       (!multirom_path_exists(b, "root.img") && rom->partition))
+    if ((HAS_FILES(RF_ROOT) && !HAS_FILES(RF_BOOT_IMG)) ||
+       (HAS_FILES(RF_ROOT_IMG) && rom->partition))
     {
         // try to copy rom_info.txt in there, ubuntu is deprecated
         ERROR("Found deprecated Ubuntu 13.04, trying to copy rom_info.txt...\n");
@@ -1269,7 +1204,7 @@ int multirom_get_rom_type(struct multirom_rom *rom)
     }
 
     // Handle ubuntu 12.10
-    if(!multirom_path_exists(b, "root") && !multirom_path_exists(b, "boot.img"))
+    if(HAS_FILES(RF_ROOT | RF_BOOT_IMG))
     {
         if(!rom->partition) return ROM_UNSUPPORTED_INT;
         else                return ROM_UNSUPPORTED_USB;
@@ -1278,6 +1213,13 @@ int multirom_get_rom_type(struct multirom_rom *rom)
     return ROM_UNKNOWN;
 }
 
+#undef HAS_FILES
+
+int multirom_get_rom_type(struct multirom_rom *rom)
+{
+    return multirom_get_rom_type_from_files(rom, multirom_get_rom_files(rom->base_path));
+}
+
 void multirom_import_internal(void)
 {
     char path[256];
@@ -1963,12 +1905,126 @@ int multirom_get_trampoline_ver(void)
     return ver;
 }
 
+// Probing kexec needs /proc/config.gz scan and "kexec -u" test, which
+// only have to be done once per kernel build. The result is stored
+// in mrom_dir() along with /proc/version of the probed kernel.
+#define KEXEC_PROBE_CACHE "kexec_probe"
+
+static int multirom_read_kernel_version(char *buf, size_t size)
+{
+    FILE *f = fopen("/proc/version", "re");
+    if(!f)
+        return -1;
+
+    if(!fgets(buf, size, f))
+    {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+static int multirom_load_kexec_probe(const char *kernel_version)
+{
+    char path[256];
+    char *data, *nl;
+    size_t size;
+    int res = -1, ver = -1, val = -1;
+
+    snprintf(path, sizeof(path), "%s/" KEXEC_PROBE_CACHE, mrom_dir());
+    data = read_whole_file(path, &size);
+    if(!data)
+        return -1;
+
+    data = realloc(data, size + 1);
+    data[size] = 0;
+
+    // "<has_kexec> <multirom version>\n<contents of /proc/version>"
+    nl = strchr(data, '\n');
+    if(nl && sscanf(data, "%d %d", &val, &ver) == 2 && ver == VERSION_MULTIROM &&
+        (val == 0 || val == 1) && strcmp(nl+1, kernel_version) == 0)
+    {
+        res = val;
+    }
+
+    free(data);
+    return res;
+}
+
+static void multirom_save_kexec_probe(const char *kernel_version, int has_kexec)
+{
+    char path[256];
+    char *data;
+    int len;
+
+    len = asprintf(&data, "%d %d\n%s", has_kexec, VERSION_MULTIROM, kernel_version);
+    if(len < 0)
+        return;
+
+    snprintf(path, sizeof(path), "%s/" KEXEC_PROBE_CACHE, mrom_dir());
+    if(write_whole_file(path, data, len) < 0)
+        ERROR("Failed to write %s\n", path);
+    free(data);
+}
+
+// Checks all options in one pass over /proc/config.gz, returns
+// 1 if all of them are enabled.
+static int multirom_check_ikconfig(const char * const *checks, uint32_t cnt)
+{
+    char line[1024];
+    uint32_t i, found = 0;
+    size_t len;
+    gzFile f;
+
+    f = gzopen("/proc/config.gz", "rb");
+    if(!f)
+    {
+        ERROR("Failed to open /proc/config.gz!\n");
+        return 0;
+    }
+
+    while(found != (1u << cnt) - 1 && gzgets(f, line, sizeof(line)))
+    {
+        if(strncmp(line, "CONFIG_", 7) != 0)
+            continue;
+
+        for(i = 0; i < cnt; ++i)
+        {
+            len = strlen(checks[i]);
+            if(strncmp(line, checks[i], len) == 0 && (line[len] == '\n' || line[len] == 0))
+                found |= (1 << i);
+        }
+    }
+    gzclose(f);
+
+    for(i = 0; i < cnt; ++i)
+        if(!(found & (1 << i)))
+            ERROR("%s not found in /proc/config.gz!\n", checks[i]);
+
+    return found == (1u << cnt) - 1;
+}
+
 int multirom_has_kexec(void)
 {
     static int has_kexec = -1;
+    char kernel_version[512];
+    int version_valid;
+
     if(has_kexec != -1)
         return has_kexec;
 
+    version_valid = multirom_read_kernel_version(kernel_version, sizeof(kernel_version)) >= 0;
+    if(version_valid)
+    {
+        has_kexec = multirom_load_kexec_probe(kernel_version);
+        if(has_kexec != -1)
+        {
+            INFO("Using cached kexec probe result: %d\n", has_kexec);
+            return has_kexec;
+        }
+    }
+
 #if MR_DEVICE_HOOKS >= 5
     has_kexec = mrom_hook_has_kexec();
 #endif
@@ -1977,15 +2033,6 @@ int multirom_has_kexec(void)
     {
         if(access("/proc/config.gz", F_OK) >= 0)
         {
-            char *cmd_cp[] = { busybox_path, "cp", "/proc/config.gz", "/ikconfig.gz", NULL };
-            run_cmd(cmd_cp);
-
-            char *cmd_gzip[] = { busybox_path, "gzip", "-d", "/ikconfig.gz", NULL };
-            run_cmd(cmd_gzip);
-
-            has_kexec = 1;
-
-            uint32_t i;
             static const char *checks[] = {
                 "CONFIG_KEXEC_HARDBOOT=y",
 #ifndef MR_KEXEC_DTB
@@ -1994,19 +2041,8 @@ int multirom_has_kexec(void)
                 "CONFIG_PROC_DEVICETREE=y",
 #endif
             };
-            //                   0             1       2     3
-            char *cmd_grep[] = { busybox_path, "grep", NULL, "/ikconfig", NULL };
-            for(i = 0; i < ARRAY_SIZE(checks); ++i)
-            {
-                cmd_grep[2] = (char*)checks[i];
-                if(run_cmd(cmd_grep) != 0)
-                {
-                    has_kexec = 0;
-                    ERROR("%s not found in /proc/config.gz!\n", checks[i]);
-                }
-            }
 
-            remove("/ikconfig");
+            has_kexec = multirom_check_ikconfig(checks, ARRAY_SIZE(checks));
         }
         else
         {
@@ -2034,6 +2070,9 @@ int multirom_has_kexec(void)
         has_kexec = 0;
     }
 
+    if(version_valid)
+        multirom_save_kexec_probe(kernel_version, has_kexec);
+
     return has_kexec;
 }
 
@@ -2191,87 +2230,265 @@ exit:
     return res;
 }
 
-int multirom_fill_kexec_android(struct multirom_status *s, struct multirom_rom *rom, struct kexec *kexec)
+// Extracted kernel, ramdisk and dtb of secondary Android ROMs are kept in
+// <rom>/KEXEC_CACHE_DIR, so that booting an unchanged ROM doesn't need to
+// inject and unpack the boot.img again. The cache is valid as long as
+// the boot.img has the same size, mtime and crc32 and trampoline version
+// didn't change.
+#define KEXEC_CACHE_DIR ".kexec_cache"
+#define KEXEC_CACHE_KEY_VER 1
+
+struct kexec_cache_key
 {
-    int res = -1;
-    char img_path[256];
-    snprintf(img_path, sizeof(img_path), "%s/boot.img", rom->base_path);
+    unsigned long long size;
+    long long mtime;
+    uint32_t crc;
+    int tr_ver;
+    int has_dtb;
+};
 
-    // Trampolines in ROM boot images may get out of sync, so we need to check it and
-    // update if needed. I can't do that during ZIP installation because of USB drives.
-    if(inject_bootimg(img_path, 0) < 0)
-    {
-        ERROR("Failed to inject bootimg!\n");
+static int kexec_cache_get_key(const char *img_path, struct kexec_cache_key *key)
+{
+    struct stat info;
+    uint8_t *buf;
+    ssize_t r;
+    uLong crc;
+    int fd;
+
+    fd = open(img_path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
         return -1;
-    }
 
-    struct bootimg img;
-    if(libbootimg_init_load(&img, img_path, LIBBOOTIMG_LOAD_ALL) < 0)
+    if(fstat(fd, &info) < 0)
     {
-        ERROR("fill_kexec could not open boot image (%s)!\n", img_path);
+        close(fd);
         return -1;
     }
 
-    if(libbootimg_dump_kernel(&img, "/zImage") < 0)
-        goto exit;
-
-    if(libbootimg_dump_ramdisk(&img, "/initrd.img") < 0)
-        goto exit;
+    buf = malloc(1 << 20);
+    crc = crc32(0, NULL, 0);
+    while((r = read(fd, buf, 1 << 20)) > 0)
+        crc = crc32(crc, buf, r);
+    free(buf);
+    close(fd);
 
-    kexec_add_kernel(kexec, "/zImage", 1);
-    kexec_add_arg(kexec, "--initrd=/initrd.img");
+    if(r < 0)
+        return -1;
 
-#ifdef MR_KEXEC_DTB
-    if(libbootimg_dump_dtb(&img, "/dtb.img") >= 0)
-        kexec_add_arg(kexec, "--dtb=/dtb.img");
-    else
-        kexec_add_arg(kexec, "--dtb");
-#endif
+    key->size = info.st_size;
+    key->mtime = info.st_mtime;
+    key->crc = crc;
+    key->tr_ver = VERSION_TRAMPOLINE;
+    return 0;
+}
 
-    char cmdline[1536];
-    strcpy(cmdline, "--command-line=");
+static int kexec_cache_load(const char *cache_dir, const char *img_path, char *bootimg_cmdline, struct kexec_cache_key *key)
+{
+    struct kexec_cache_key cur;
+    char path[256];
+    char *data;
+    size_t size;
+    int ver;
 
-    if(img.hdr.cmdline[0] != 0)
-    {
-        img.hdr.cmdline[BOOT_ARGS_SIZE-1] = 0;
+    snprintf(path, sizeof(path), "%s/key", cache_dir);
+    data = read_whole_file(path, &size);
+    if(!data)
+        return -1;
 
-        // see multirom_get_bootloader_cmdline
-#if MR_DEVICE_HOOKS >= 5
-        mrom_hook_fixup_bootimg_cmdline((char*)img.hdr.cmdline, BOOT_ARGS_SIZE);
-#endif
+    data = realloc(data, size + 1);
+    data[size] = 0;
+    ver = -1;
+    sscanf(data, "%d %llu %lld %x %d %d", &ver, &key->size, &key->mtime, &key->crc, &key->tr_ver, &key->has_dtb);
+    free(data);
 
-        strcat(cmdline, (char*)img.hdr.cmdline);
-        strcat(cmdline, " ");
-    }
+    if(ver != KEXEC_CACHE_KEY_VER || kexec_cache_get_key(img_path, &cur) < 0)
+        return -1;
 
-    if(multirom_get_bootloader_cmdline(s, cmdline+strlen(cmdline), sizeof(cmdline)-strlen(cmdline)-1) == -1)
+    if(cur.size != key->size || cur.mtime != key->mtime || cur.crc != key->crc || cur.tr_ver != key->tr_ver)
     {
-        ERROR("Failed to get cmdline\n");
-        goto exit;
+        INFO("boot.img changed, kexec cache in %s is stale\n", cache_dir);
+        return -1;
     }
 
-    if(!strstr(cmdline, " mrom_kexecd=1") && sizeof(cmdline)-strlen(cmdline)-1 >= sizeof("mrom_kexecd=1"))
-        strcat(cmdline, "mrom_kexecd=1");
-
-#if MR_DEVICE_HOOKS >= 6
-    mrom_hook_fixup_full_cmdline(cmdline, sizeof(cmdline));
-#endif
+    snprintf(path, sizeof(path), "%s/cmdline", cache_dir);
+    data = read_whole_file(path, &size);
+    if(!data)
+        return -1;
+    size = imin(size, BOOT_ARGS_SIZE-1);
+    memcpy(bootimg_cmdline, data, size);
+    bootimg_cmdline[size] = 0;
+    free(data);
 
-    kexec_add_arg(kexec, cmdline);
+    snprintf(path, sizeof(path), "%s/zImage", cache_dir);
+    if(access(path, F_OK) < 0)
+        return -1;
+    snprintf(path, sizeof(path), "%s/initrd.img", cache_dir);
+    if(access(path, F_OK) < 0)
+        return -1;
 
-    res = 0;
-exit:
-    libbootimg_destroy(&img);
-    return res;
+    INFO("Using cached kexec files from %s\n", cache_dir);
+    return 0;
 }
 
-static char *find_boot_file(char *path, char *root_path, char *base_path)
+static void kexec_cache_store(const char *cache_dir, const char *img_path, struct kexec_cache_key *key)
 {
-    if(!path)
-        return NULL;
+    char path[256];
+    char buf[128];
+    int len;
 
-    struct stat info;
-    char cmd[256];
+    if(kexec_cache_get_key(img_path, key) < 0)
+        return;
+
+    len = snprintf(buf, sizeof(buf), "%d %llu %lld %08x %d %d\n", KEXEC_CACHE_KEY_VER,
+            key->size, key->mtime, key->crc, key->tr_ver, key->has_dtb);
+
+    snprintf(path, sizeof(path), "%s/key", cache_dir);
+    if(write_whole_file(path, buf, len) < 0)
+        ERROR("Failed to write %s\n", path);
+}
+
+// Unpacks the boot.img into dir, which is either the cache
+// directory or "" for files in root.
+static int multirom_extract_bootimg(const char *img_path, const char *dir, char *bootimg_cmdline, struct kexec_cache_key *key)
+{
+    int res = -1;
+    struct bootimg img;
+    char path[256];
+
+    if(libbootimg_init_load(&img, img_path, LIBBOOTIMG_LOAD_ALL) < 0)
+    {
+        ERROR("fill_kexec could not open boot image (%s)!\n", img_path);
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/zImage", dir);
+    if(libbootimg_dump_kernel(&img, path) < 0)
+        goto exit;
+
+    snprintf(path, sizeof(path), "%s/initrd.img", dir);
+    if(libbootimg_dump_ramdisk(&img, path) < 0)
+        goto exit;
+
+    key->has_dtb = 0;
+#ifdef MR_KEXEC_DTB
+    snprintf(path, sizeof(path), "%s/dtb.img", dir);
+    key->has_dtb = libbootimg_dump_dtb(&img, path) >= 0;
+#endif
+
+    img.hdr.cmdline[BOOT_ARGS_SIZE-1] = 0;
+    strcpy(bootimg_cmdline, (char*)img.hdr.cmdline);
+
+    if(dir[0])
+    {
+        snprintf(path, sizeof(path), "%s/cmdline", dir);
+        write_whole_file(path, bootimg_cmdline, strlen(bootimg_cmdline));
+    }
+
+    res = 0;
+exit:
+    libbootimg_destroy(&img);
+    return res;
+}
+
+int multirom_fill_kexec_android(struct multirom_status *s, struct multirom_rom *rom, struct kexec *kexec)
+{
+    char img_path[256];
+    char cache_dir[256];
+    char path[256];
+    char bootimg_cmdline[BOOT_ARGS_SIZE];
+    struct kexec_cache_key key;
+    const char *dir = cache_dir;
+
+    snprintf(img_path, sizeof(img_path), "%s/boot.img", rom->base_path);
+    snprintf(cache_dir, sizeof(cache_dir), "%s/" KEXEC_CACHE_DIR, rom->base_path);
+
+    memset(&key, 0, sizeof(key));
+    if(kexec_cache_load(cache_dir, img_path, bootimg_cmdline, &key) < 0)
+    {
+        // Trampolines in ROM boot images may get out of sync, so we need to check it and
+        // update if needed. I can't do that during ZIP installation because of USB drives.
+        if(inject_bootimg(img_path, 0) < 0)
+        {
+            ERROR("Failed to inject bootimg!\n");
+            return -1;
+        }
+
+        // Invalidate the old cache before overwriting its files
+        snprintf(path, sizeof(path), "%s/key", cache_dir);
+        unlink(path);
+
+        if(mkdir(cache_dir, 0700) < 0 && errno != EEXIST)
+        {
+            ERROR("Failed to create %s (%s), not caching kexec files\n", cache_dir, strerror(errno));
+            dir = "";
+        }
+
+        if(multirom_extract_bootimg(img_path, dir, bootimg_cmdline, &key) < 0)
+        {
+            if(!dir[0])
+                return -1;
+
+            dir = "";
+            if(multirom_extract_bootimg(img_path, dir, bootimg_cmdline, &key) < 0)
+                return -1;
+        }
+        else if(dir[0])
+            kexec_cache_store(cache_dir, img_path, &key);
+    }
+
+    snprintf(path, sizeof(path), "%s/zImage", dir);
+    kexec_add_kernel(kexec, path, 1);
+    snprintf(path, sizeof(path), "--initrd=%s/initrd.img", dir);
+    kexec_add_arg(kexec, path);
+
+#ifdef MR_KEXEC_DTB
+    if(key.has_dtb)
+    {
+        snprintf(path, sizeof(path), "--dtb=%s/dtb.img", dir);
+        kexec_add_arg(kexec, path);
+    }
+    else
+        kexec_add_arg(kexec, "--dtb");
+#endif
+
+    char cmdline[1536];
+    strcpy(cmdline, "--command-line=");
+
+    if(bootimg_cmdline[0] != 0)
+    {
+        // see multirom_get_bootloader_cmdline
+#if MR_DEVICE_HOOKS >= 5
+        mrom_hook_fixup_bootimg_cmdline(bootimg_cmdline, BOOT_ARGS_SIZE);
+#endif
+
+        strcat(cmdline, bootimg_cmdline);
+        strcat(cmdline, " ");
+    }
+
+    if(multirom_get_bootloader_cmdline(s, cmdline+strlen(cmdline), sizeof(cmdline)-strlen(cmdline)-1) == -1)
+    {
+        ERROR("Failed to get cmdline\n");
+        return -1;
+    }
+
+    if(!strstr(cmdline, " mrom_kexecd=1") && sizeof(cmdline)-strlen(cmdline)-1 >= sizeof("mrom_kexecd=1"))
+        strcat(cmdline, "mrom_kexecd=1");
+
+#if MR_DEVICE_HOOKS >= 6
+    mrom_hook_fixup_full_cmdline(cmdline, sizeof(cmdline));
+#endif
+
+    kexec_add_arg(kexec, cmdline);
+    return 0;
+}
+
+static char *find_boot_file(char *path, char *root_path, char *base_path)
+{
+    if(!path)
+        return NULL;
+
+    struct stat info;
+    char cmd[256];
     char *root = strstr(path, "%r");
     if(root)
         snprintf(cmd, sizeof(cmd), "%s/%s", root_path, root+2);
@@ -2747,75 +2964,168 @@ void multirom_destroy_partition(void *part)
     free(p);
 }
 
-int multirom_update_partitions(struct multirom_status *s)
+#define PART_PROBE_THREADS 4
+
+struct part_probe
 {
-    pthread_mutex_lock(&parts_mutex);
+    char name[64];
+    struct fs_probe_res res;
+    int found;
+};
 
-    list_clear(&s->partitions, &multirom_destroy_partition);
+struct part_probe_job
+{
+    pthread_mutex_t mutex;
+    struct part_probe *probes;
+    int cnt;
+    int next;
+};
+
+static int multirom_ignore_partition(const char *name)
+{
+    // ignore internal nand and loop devices
+    return strncmp(name, "mmcblk0", 7) == 0 || strncmp(name, "dm-", 3) == 0 ||
+        strncmp(name, "sd", 2) == 0 || strncmp(name, "loop", 4) == 0;
+}
+
+static void *multirom_probe_partitions_thread(void *data)
+{
+    struct part_probe_job *job = data;
+    struct part_probe *p;
+    char path[128];
+    int idx;
 
-    int exit_code = 0;
-    char *cmd[] = { busybox_path, "blkid", NULL };
-    char *res = run_get_stdout_with_exit(cmd, &exit_code);
-    if(exit_code != 0 || res == NULL)
+    while(1)
     {
-        free(res);
-        pthread_mutex_unlock(&parts_mutex);
-        return exit_code == 0 ? 0 : -1;
+        pthread_mutex_lock(&job->mutex);
+        idx = job->next++;
+        pthread_mutex_unlock(&job->mutex);
+
+        if(idx >= job->cnt)
+            break;
+
+        p = &job->probes[idx];
+        snprintf(path, sizeof(path), "/dev/block/%s", p->name);
+        p->found = (fs_probe(path, &p->res) == 0);
     }
+    return NULL;
+}
 
-    char *tok;
-    char *name;
-    struct usb_partition *part;
+// Reads superblocks of all block devices from /proc/partitions,
+// several devices at a time because slow USB drives can take a while.
+// Returns number of entries in *res or -1.
+static int multirom_probe_partitions(struct part_probe **res)
+{
+    struct part_probe_job job;
+    pthread_t threads[PART_PROBE_THREADS];
+    char line[256];
+    char name[64];
+    int i, started = 0, cap = 0;
+    FILE *f;
 
-    char *line = strtok(res, "\n");
-    while(line != NULL)
+    f = fopen("/proc/partitions", "re");
+    if(!f)
     {
-        if(strstr(line, "/dev/") != line)
-        {
-            ERROR("blkid line does not start with /dev/!\n");
-            break;
-        }
+        ERROR("Failed to open /proc/partitions!\n");
+        return -1;
+    }
+
+    memset(&job, 0, sizeof(job));
+    while(fgets(line, sizeof(line), f))
+    {
+        if(sscanf(line, "%*u %*u %*u %63s", name) != 1 || multirom_ignore_partition(name))
+            continue;
 
-        tok = strrchr(line, '/')+1;
-        name = strndup(tok, strchr(tok, ':') - tok);
-        if(strncmp(name, "mmcblk0", 7) == 0 || strncmp(name, "dm-", 3) == 0 || strncmp(name, "sd", 2) == 0) // ignore internal nand
+        if(job.cnt == cap)
         {
-            free(name);
-            goto next_itr;
+            cap = imax(8, cap*2);
+            job.probes = realloc(job.probes, cap*sizeof(struct part_probe));
         }
 
-        if(strncmp(name, "loop", 4) == 0) // ignore loop devices
+        memset(&job.probes[job.cnt], 0, sizeof(struct part_probe));
+        strcpy(job.probes[job.cnt].name, name);
+        ++job.cnt;
+    }
+    fclose(f);
+
+    pthread_mutex_init(&job.mutex, NULL);
+    for(i = 0; i < imin(job.cnt, PART_PROBE_THREADS) - 1; ++i)
+    {
+        if(pthread_create(&threads[i], NULL, multirom_probe_partitions_thread, &job) != 0)
+            break;
+        ++started;
+    }
+    multirom_probe_partitions_thread(&job);
+    for(i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&job.mutex);
+
+    *res = job.probes;
+    return job.cnt;
+}
+
+static void multirom_queue_usb_event(int type, struct usb_partition *part);
+
+// With queue_events, removed partitions are not destroyed right away
+// and both changes are queued for multirom_apply_usb_event().
+static int multirom_update_partitions_args(struct multirom_status *s, int queue_events)
+{
+    struct part_probe *probes = NULL;
+    struct usb_partition *part;
+    list_buf added = { NULL, 0, 0 };
+    list_buf removed = { NULL, 0, 0 };
+    int i, j, cnt;
+
+    cnt = multirom_probe_partitions(&probes);
+    if(cnt < 0)
+        return -1;
+
+    pthread_mutex_lock(&parts_mutex);
+
+    // Keep partitions which didn't change mounted, drop the rest
+    for(i = 0; s->partitions && s->partitions[i];)
+    {
+        part = s->partitions[i];
+        for(j = 0; j < cnt; ++j)
         {
-            free(name);
-            goto next_itr;
+            if(probes[j].found && strcmp(probes[j].name, part->name) == 0 &&
+                strcmp(probes[j].res.uuid, part->uuid) == 0 && strcmp(probes[j].res.type, part->fs) == 0)
+            {
+                break;
+            }
         }
 
-        part = mzalloc(sizeof(struct usb_partition));
-        part->name = name;
-
-        tok = strstr(line, "UUID=\"");
-        if(tok)
+        if(j < cnt)
         {
-            tok += sizeof("UUID=\"")-1;
-            part->uuid = strndup(tok, strchr(tok, '"') - tok);
+            probes[j].found = 0;
+            ++i;
         }
         else
         {
-            ERROR("Part %s does not have UUID, line: \"%s\"\n", part->name, line);
-            multirom_destroy_partition(part);
-            goto next_itr;
+            INFO("Part %s (%s) was removed\n", part->name, part->uuid);
+            list_rm_at(&s->partitions, i, NULL);
+            if(queue_events)
+                list_buf_add(&removed, part);
+            else
+                multirom_destroy_partition(part);
         }
+    }
 
-        tok = strstr(line, "TYPE=\"");
-        if(tok)
-        {
-            tok += sizeof("TYPE=\"")-1;
-            part->fs = strndup(tok, strchr(tok, '"') - tok);
-        }
+    for(i = 0; i < cnt; ++i)
+    {
+        if(!probes[i].found)
+            continue;
+
+        part = mzalloc(sizeof(struct usb_partition));
+        part->name = strdup(probes[i].name);
+        part->uuid = strdup(probes[i].res.uuid);
+        part->fs = strdup(probes[i].res.type);
 
-        if(part->fs && multirom_mount_usb(part) == 0)
+        if(multirom_mount_usb(part) == 0)
         {
             list_add(&s->partitions, part);
+            if(queue_events)
+                list_buf_add(&added, part);
             ERROR("Found part %s: %s, %s\n", part->name, part->uuid, part->fs);
         }
         else
@@ -2823,16 +3133,25 @@ int multirom_update_partitions(struct multirom_status *s)
             ERROR("Failed to mount part %s %s, %s\n", part->name, part->uuid, part->fs);
             multirom_destroy_partition(part);
         }
-
-next_itr:
-        line = strtok(NULL, "\n");
     }
     pthread_mutex_unlock(&parts_mutex);
-    free(res);
+    free(probes);
+
+    for(i = 0; i < removed.len; ++i)
+        multirom_queue_usb_event(USB_EVENT_REMOVED, removed.items[i]);
+    for(i = 0; i < added.len; ++i)
+        multirom_queue_usb_event(USB_EVENT_ADDED, added.items[i]);
+    list_buf_clear(&removed, NULL);
+    list_buf_clear(&added, NULL);
 
     return 0;
 }
 
+int multirom_update_partitions(struct multirom_status *s)
+{
+    return multirom_update_partitions_args(s, 0);
+}
+
 int is_mounted_properly(const char *src, const char *mnt_path)
 {
     int res = 0;
@@ -2960,57 +3279,248 @@ void multirom_update_and_scan_for_external_roms(struct multirom_status *s, char
     }
     else
     {
-        // external partition exist, multirom_update_partitions will destroy all partitions information, so
-        // so we'll just use multirom_find_usb_roms(s) to repopulate everything, the alternative is just too
-        // much unnecessary code
+        // external partitions are already known and mounted, so just
+        // use multirom_find_usb_roms(s) to repopulate the ROMs on them
         multirom_find_usb_roms(s);
     }
 }
 
-void *multirom_usb_refresh_thread_work(void *status)
+static void multirom_queue_usb_event(int type, struct usb_partition *part)
 {
-    uint32_t timer = 0;
-    struct stat info;
+    struct usb_event *ev = mzalloc(sizeof(struct usb_event));
+    ev->type = type;
+    ev->part = part;
 
-    // stat.st_ctime is defined as unsigned long instead
-    // of time_t in android
-    unsigned long last_ctime = 0;
-    unsigned long last_ctime_nsec = 0;
+    pthread_mutex_lock(&parts_mutex);
+    list_buf_add(&usb_events, ev);
+    pthread_mutex_unlock(&parts_mutex);
 
-    while(run_usb_refresh)
+    if(usb_refresh_handler)
+        (*usb_refresh_handler)();
+}
+
+// Takes the partition out of s->partitions, the ROMs on it still point
+// to it, so it is destroyed only once the USB_EVENT_REMOVED is applied.
+static void multirom_usb_part_removed(struct multirom_status *s, const char *name)
+{
+    struct usb_partition *part = NULL;
+    int i;
+
+    pthread_mutex_lock(&parts_mutex);
+    for(i = 0; s->partitions && s->partitions[i]; ++i)
     {
-        if(timer <= 50)
+        if(strcmp(s->partitions[i]->name, name) == 0)
         {
-            if (stat("/dev/block", &info) >= 0 &&
-                (info.st_ctime != last_ctime || info.st_ctimensec != last_ctime_nsec))
+            part = s->partitions[i];
+            list_rm_at(&s->partitions, i, NULL);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&parts_mutex);
+
+    if(part)
+    {
+        INFO("Part %s (%s) was removed\n", part->name, part->uuid);
+        multirom_queue_usb_event(USB_EVENT_REMOVED, part);
+    }
+}
+
+static void multirom_usb_part_added(struct multirom_status *s, const char *name)
+{
+    struct fs_probe_res res;
+    struct usb_partition *part;
+    char path[128];
+    const char *files[] = { path, NULL };
+    int i;
+
+    snprintf(path, sizeof(path), "/dev/block/%s", name);
+
+    // trampoline's ueventd creates the node from this same event
+    if(wait_for_files(files, USB_NODE_TIMEOUT_MS) < 0)
+    {
+        ERROR("Block device %s did not show up\n", path);
+        return;
+    }
+
+    memset(&res, 0, sizeof(res));
+    fs_probe(path, &res);
+
+    pthread_mutex_lock(&parts_mutex);
+    for(i = 0; s->partitions && s->partitions[i]; ++i)
+    {
+        part = s->partitions[i];
+        if(strcmp(part->name, name) == 0)
+        {
+            // "change" event for a partition we already have
+            if(strcmp(part->uuid, res.uuid) == 0 && strcmp(part->fs, res.type) == 0)
             {
-                multirom_update_partitions((struct multirom_status*)status);
+                pthread_mutex_unlock(&parts_mutex);
+                return;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&parts_mutex);
 
-                if(usb_refresh_handler)
-                    (*usb_refresh_handler)();
+    multirom_usb_part_removed(s, name);
+
+    // whole disks with a partition table end up here too
+    if(res.type[0] == 0)
+        return;
+
+    part = mzalloc(sizeof(struct usb_partition));
+    part->name = strdup(name);
+    part->uuid = strdup(res.uuid);
+    part->fs = strdup(res.type);
+
+    if(multirom_mount_usb(part) != 0)
+    {
+        ERROR("Failed to mount part %s %s, %s\n", part->name, part->uuid, part->fs);
+        multirom_destroy_partition(part);
+        return;
+    }
+
+    ERROR("Found part %s: %s, %s\n", part->name, part->uuid, part->fs);
+
+    pthread_mutex_lock(&parts_mutex);
+    list_add(&s->partitions, part);
+    pthread_mutex_unlock(&parts_mutex);
+
+    multirom_queue_usb_event(USB_EVENT_ADDED, part);
+}
 
-                last_ctime = info.st_ctime;
-                last_ctime_nsec = info.st_ctimensec;
+static void multirom_handle_block_uevent(struct multirom_status *s, const char *msg, ssize_t len)
+{
+    const char *end = msg + len;
+    const char *action = NULL;
+    const char *subsystem = NULL;
+    const char *devname = NULL;
+
+    // "action@devpath\0KEY=value\0KEY=value\0..."
+    for(; msg < end; msg += strlen(msg) + 1)
+    {
+        if(strncmp(msg, "ACTION=", 7) == 0)
+            action = msg + 7;
+        else if(strncmp(msg, "SUBSYSTEM=", 10) == 0)
+            subsystem = msg + 10;
+        else if(strncmp(msg, "DEVNAME=", 8) == 0)
+            devname = msg + 8;
+    }
+
+    if(!action || !subsystem || !devname || strcmp(subsystem, "block") != 0)
+        return;
+
+    if(strchr(devname, '/') || strlen(devname) >= USB_NAME_MAX || multirom_ignore_partition(devname))
+        return;
+
+    if(strcmp(action, "add") == 0 || strcmp(action, "change") == 0)
+        multirom_usb_part_added(s, devname);
+    else if(strcmp(action, "remove") == 0)
+        multirom_usb_part_removed(s, devname);
+}
+
+static void *multirom_usb_refresh_thread_work(void *status)
+{
+    struct multirom_status *s = status;
+    struct pollfd fds[2];
+    char buf[USB_UEVENT_MSG_SIZE];
+    uint64_t val;
+    ssize_t len;
+    int sock;
+
+    // Open the socket before the first scan, so that nothing plugged in
+    // in the meantime gets lost.
+    sock = uevent_open_socket(USB_UEVENT_SOCKET_SIZE, true);
+    if(sock < 0)
+        ERROR("Failed to open uevent socket, USB drives will only be found on manual refresh!\n");
+    else
+        fcntl(sock, F_SETFL, O_NONBLOCK);
+
+    multirom_update_partitions_args(s, 1);
+
+    fds[0].fd = sock;
+    fds[0].events = POLLIN;
+    fds[1].fd = usb_refresh_wake_fd;
+    fds[1].events = POLLIN;
+
+    while(run_usb_refresh)
+    {
+        fds[0].revents = fds[1].revents = 0;
+        if(poll(fds, 2, -1) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            ERROR("usb refresh: poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        // manual refresh requested, or the thread is being stopped
+        if((fds[1].revents & POLLIN) && read(usb_refresh_wake_fd, &val, sizeof(val)) > 0 && run_usb_refresh)
+            multirom_update_partitions_args(s, 1);
+
+        if(fds[0].revents & POLLIN)
+        {
+            while((len = uevent_kernel_multicast_recv(sock, buf, sizeof(buf)-1)) > 0)
+            {
+                buf[len] = 0;
+                multirom_handle_block_uevent(s, buf, len);
             }
-            timer = 500;
+
+            // the socket buffer overflowed, some events were lost
+            if(len < 0 && errno == ENOBUFS)
+                multirom_update_partitions_args(s, 1);
         }
-        else
-            timer -= 50;
-        usleep(50000);
     }
+
+    if(sock >= 0)
+        close(sock);
     return NULL;
 }
 
 void multirom_set_usb_refresh_thread(struct multirom_status *s, int run)
 {
+    uint64_t val = 1;
+    struct usb_event **events;
+    int i;
+
     if(run_usb_refresh == run)
         return;
 
-    run_usb_refresh = run;
     if(run)
+    {
+        usb_refresh_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if(usb_refresh_wake_fd < 0)
+        {
+            ERROR("Failed to create usb refresh eventfd: %s\n", strerror(errno));
+            return;
+        }
+
+        run_usb_refresh = 1;
         pthread_create(&usb_refresh_thread, NULL, multirom_usb_refresh_thread_work, s);
+    }
     else
+    {
+        run_usb_refresh = 0;
+        if(write(usb_refresh_wake_fd, &val, sizeof(val)) < 0)
+            ERROR("Failed to wake up usb refresh thread: %s\n", strerror(errno));
         pthread_join(usb_refresh_thread, NULL);
+
+        close(usb_refresh_wake_fd);
+        usb_refresh_wake_fd = -1;
+
+        // nobody will pick up what is left, keep s->roms consistent
+        events = multirom_take_usb_events();
+        for(i = 0; events && events[i]; ++i)
+            multirom_apply_usb_event(s, events[i]);
+        list_clear(&events, &free);
+    }
+}
+
+void multirom_request_usb_refresh(void)
+{
+    uint64_t val = 1;
+    if(run_usb_refresh && write(usb_refresh_wake_fd, &val, sizeof(val)) < 0)
+        ERROR("Failed to wake up usb refresh thread: %s\n", strerror(errno));
 }
 
 void multirom_set_usb_refresh_handler(void (*handler)(void))
@@ -3018,6 +3528,42 @@ void multirom_set_usb_refresh_handler(void (*handler)(void))
     usb_refresh_handler = handler;
 }
 
+struct usb_event **multirom_take_usb_events(void)
+{
+    struct usb_event **res;
+    pthread_mutex_lock(&parts_mutex);
+    res = (struct usb_event**)list_buf_detach(&usb_events);
+    pthread_mutex_unlock(&parts_mutex);
+    return res;
+}
+
+void multirom_apply_usb_event(struct multirom_status *s, struct usb_event *ev)
+{
+    int i;
+
+    switch(ev->type)
+    {
+        case USB_EVENT_ADDED:
+            multirom_scan_partition_for_roms(s, ev->part);
+            break;
+        case USB_EVENT_REMOVED:
+            if(s->current_rom && s->current_rom->partition == ev->part)
+                s->current_rom = multirom_get_internal(s);
+            if(s->auto_boot_rom && s->auto_boot_rom->partition == ev->part)
+                s->auto_boot_rom = multirom_get_internal(s);
+
+            for(i = 0; s->roms && s->roms[i];)
+            {
+                if(s->roms[i]->partition == ev->part)
+                    list_rm_at(&s->roms, i, &multirom_free_rom);
+                else
+                    ++i;
+            }
+            multirom_destroy_partition(ev->part);
+            break;
+    }
+}
+
 char *multirom_get_klog(void)
 {
     int len = klogctl(10, NULL, 0);
@@ -3120,50 +3666,52 @@ int multirom_run_scripts(const char *type, struct multirom_rom *rom)
     return 0;
 }
 
+#define IC_TYPE_NONE  -1
 #define IC_TYPE_PREDEF 0
 #define IC_TYPE_USER   1
 #define USER_IC_PATH "Android/data/com.tassadar.multirommgr/files"
 #define DEFAULT_ICON "icons/romic_default.png"
 #define DEFAULT_ANDROID_ICON "icons/romic_android_default.png"
 
-void multirom_find_rom_icon(struct multirom_rom *rom)
+// Returns IC_TYPE_* from rom's .icon_data, icon name is stored to name
+static int multirom_read_icon_data(const char *base_path, char *name, size_t size)
 {
     FILE *f;
-    int type = 0, len;
+    int type = IC_TYPE_NONE, len;
     char buff[256];
 
-    snprintf(buff, sizeof(buff), "%s/.icon_data", rom->base_path);
+    snprintf(buff, sizeof(buff), "%s/.icon_data", base_path);
 
     f = fopen(buff, "re");
     if(!f)
-        goto fail;
+        return IC_TYPE_NONE;
 
-    if(!fgets(buff, sizeof(buff), f))
-        goto fail;
+    if(fgets(buff, sizeof(buff), f))
+    {
+        if(strcmp(buff, "predef_set\n") == 0)
+            type = IC_TYPE_PREDEF;
+        else if(strcmp(buff, "user_defined\n") == 0)
+            type = IC_TYPE_USER;
+    }
 
-    if(strcmp(buff, "predef_set\n") == 0)
-        type = IC_TYPE_PREDEF;
-    else if(strcmp(buff, "user_defined\n") == 0)
-        type = IC_TYPE_USER;
+    if(type != IC_TYPE_NONE && fgets(name, size, f) && (len = strlen(name)) >= 2)
+        name[--len] = 0; // remove \n
     else
-        goto fail;
+        type = IC_TYPE_NONE;
 
-    if(!fgets(buff, sizeof(buff), f))
-        goto fail;
     fclose(f);
-    f = NULL;
-
-    len = strlen(buff);
-    if(len < 2)
-        goto fail;
+    return type;
+}
 
-    buff[--len] = 0; // remove \n
+static void multirom_set_rom_icon(struct multirom_rom *rom, int type, const char *name)
+{
+    int len;
 
     switch(type)
     {
         case IC_TYPE_PREDEF:
         {
-            char *ic_name = strrchr(buff, '/');
+            const char *ic_name = strrchr(name, '/');
             if(!ic_name)
                 goto fail;
 
@@ -3174,11 +3722,13 @@ void multirom_find_rom_icon(struct multirom_rom *rom)
         }
         case IC_TYPE_USER:
         {
-            len = strlen(datamedia_dir) + 1 + sizeof(USER_IC_PATH) + 1 + len + 4; // + / + / + .png + \0 (sizeof() includes trailing null)
+            len = strlen(datamedia_dir) + 1 + sizeof(USER_IC_PATH) + 1 + strlen(name) + 4; // + / + / + .png + \0 (sizeof() includes trailing null)
             rom->icon_path = malloc(len);
-            snprintf(rom->icon_path, len, "%s/%s/%s.png", datamedia_dir, USER_IC_PATH, buff);
+            snprintf(rom->icon_path, len, "%s/%s/%s.png", datamedia_dir, USER_IC_PATH, name);
             break;
         }
+        default:
+            goto fail;
     }
 
     if(access(rom->icon_path, F_OK) < 0)
@@ -3186,9 +3736,6 @@ void multirom_find_rom_icon(struct multirom_rom *rom)
 
     return;
 fail:
-    if(f)
-        fclose(f);
-
     if (rom->type & MASK_ANDROID) {
         len = strlen(mrom_dir()) + 1 + sizeof(DEFAULT_ANDROID_ICON);  // sizeof() includes trailing null
         rom->icon_path = realloc(rom->icon_path, len);
@@ -3200,3 +3747,314 @@ fail:
         snprintf(rom->icon_path, len, "%s/%s", mrom_dir(), DEFAULT_ICON);
     }
 }
+
+void multirom_find_rom_icon(struct multirom_rom *rom)
+{
+    char name[256];
+    int type = multirom_read_icon_data(rom->base_path, name, sizeof(name));
+    multirom_set_rom_icon(rom, type, name);
+}
+
+#define ROM_INDEX_FILE ".rom_index"
+#define ROM_INDEX_HEADER "rom_index 1\n"
+#define ROM_PROBE_THREADS 4
+// ROMs changed this close to the index write might change again within
+// the same mtime tick (FAT has 2s resolution), don't put them into the
+// index yet.
+#define ROM_INDEX_MIN_AGE 3
+
+// What multirom_scan_roms_dir() remembers about each ROM. It is valid
+// as long as mtimes of the ROM's folder and its .icon_data match.
+struct rom_index_entry
+{
+    int64_t dir_mtime;
+    int64_t icon_mtime;
+    int type;
+    int has_bootimg;
+    int icon_type;
+    char icon_name[256];
+};
+
+struct rom_probe
+{
+    struct multirom_rom *rom;
+    struct rom_index_entry e;
+    int cached;
+};
+
+struct rom_probe_job
+{
+    pthread_mutex_t mutex;
+    struct rom_probe **probes;
+    int cnt;
+    int next;
+};
+
+static int64_t multirom_stat_mtime(int dfd, const char *path)
+{
+    struct stat info;
+    if(fstatat(dfd, path, &info, 0) < 0)
+        return -1;
+    return (int64_t)info.st_mtime * 1000000000LL + info.st_mtimensec;
+}
+
+static map *multirom_load_rom_index(int dfd)
+{
+    map *index = map_create_hashed();
+    struct rom_index_entry *e;
+    char line[1024];
+    char name[256];
+    long long dir_mtime, icon_mtime;
+    FILE *f;
+    int fd;
+
+    fd = openat(dfd, ROM_INDEX_FILE, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return index;
+
+    f = fdopen(fd, "re");
+    if(!f)
+    {
+        close(fd);
+        return index;
+    }
+
+    if(!fgets(line, sizeof(line), f) || strcmp(line, ROM_INDEX_HEADER) != 0)
+        goto exit;
+
+    while(fgets(line, sizeof(line), f))
+    {
+        e = mzalloc(sizeof(struct rom_index_entry));
+        if(sscanf(line, "%255[^\t]\t%lld\t%lld\t%d\t%d\t%d\t%255[^\n]", name, &dir_mtime, &icon_mtime,
+            &e->type, &e->has_bootimg, &e->icon_type, e->icon_name) < 6)
+        {
+            free(e);
+            continue;
+        }
+
+        e->dir_mtime = dir_mtime;
+        e->icon_mtime = icon_mtime;
+        map_add(index, name, e, &free);
+    }
+
+exit:
+    fclose(f);
+    return index;
+}
+
+// now is the mtime of the index being written. The system clock is not
+// used, it often isn't wall time yet when the boot menu runs.
+static int multirom_rom_index_too_new(int64_t mtime, int64_t now)
+{
+    const int64_t d = mtime - now;
+    return d > -ROM_INDEX_MIN_AGE*1000000000LL && d < ROM_INDEX_MIN_AGE*1000000000LL;
+}
+
+static void multirom_save_rom_index(int dfd, struct rom_probe **probes, int cnt)
+{
+    struct rom_probe *p;
+    struct stat info;
+    int64_t now;
+    FILE *f;
+    int i, fd;
+
+    fd = openat(dfd, ROM_INDEX_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+    {
+        ERROR("Failed to create ROM index: %s\n", strerror(errno));
+        return;
+    }
+
+    f = fdopen(fd, "we");
+    if(!f)
+    {
+        close(fd);
+        unlinkat(dfd, ROM_INDEX_FILE ".tmp", 0);
+        return;
+    }
+
+    // the write makes sure the mtime is from the filesystem's clock
+    fputs(ROM_INDEX_HEADER, f);
+    if(fflush(f) != 0 || fstat(fd, &info) < 0)
+    {
+        ERROR("Failed to write ROM index: %s\n", strerror(errno));
+        fclose(f);
+        unlinkat(dfd, ROM_INDEX_FILE ".tmp", 0);
+        return;
+    }
+    now = (int64_t)info.st_mtime * 1000000000LL + info.st_mtimensec;
+
+    for(i = 0; i < cnt; ++i)
+    {
+        p = probes[i];
+        if(p->e.dir_mtime < 0 || multirom_rom_index_too_new(p->e.dir_mtime, now) ||
+            (p->e.icon_mtime >= 0 && multirom_rom_index_too_new(p->e.icon_mtime, now)) ||
+            strpbrk(p->rom->name, "\t\n"))
+        {
+            continue;
+        }
+
+        fprintf(f, "%s\t%lld\t%lld\t%d\t%d\t%d\t%s\n", p->rom->name, (long long)p->e.dir_mtime,
+            (long long)p->e.icon_mtime, p->e.type, p->e.has_bootimg, p->e.icon_type,
+            p->e.icon_type != IC_TYPE_NONE ? p->e.icon_name : "");
+    }
+
+    if(fclose(f) != 0 || renameat(dfd, ROM_INDEX_FILE ".tmp", dfd, ROM_INDEX_FILE) < 0)
+    {
+        ERROR("Failed to write ROM index: %s\n", strerror(errno));
+        unlinkat(dfd, ROM_INDEX_FILE ".tmp", 0);
+    }
+}
+
+static void multirom_probe_rom(struct rom_probe *p)
+{
+    struct multirom_rom *rom = p->rom;
+    const uint32_t files = multirom_get_rom_files(rom->base_path);
+
+    rom->type = multirom_get_rom_type_from_files(rom, files);
+    rom->has_bootimg = (files & RF_BOOT_IMG) ? 1 : 0;
+
+    p->e.type = rom->type;
+    p->e.has_bootimg = rom->has_bootimg;
+    p->e.icon_type = multirom_read_icon_data(rom->base_path, p->e.icon_name, sizeof(p->e.icon_name));
+    multirom_set_rom_icon(rom, p->e.icon_type, p->e.icon_name);
+}
+
+static void *multirom_probe_roms_thread(void *data)
+{
+    struct rom_probe_job *job = data;
+    int idx;
+
+    while(1)
+    {
+        pthread_mutex_lock(&job->mutex);
+        while(job->next < job->cnt && job->probes[job->next]->cached)
+            ++job->next;
+        idx = job->next++;
+        pthread_mutex_unlock(&job->mutex);
+
+        if(idx >= job->cnt)
+            break;
+
+        multirom_probe_rom(job->probes[idx]);
+    }
+    return NULL;
+}
+
+// Probes ROMs which were not found in the index, several at a time,
+// because each one costs a dozen round-trips to slow USB drives.
+static void multirom_probe_roms(struct rom_probe **probes, int cnt, int to_probe)
+{
+    struct rom_probe_job job;
+    pthread_t threads[ROM_PROBE_THREADS];
+    int i, started = 0;
+
+    memset(&job, 0, sizeof(job));
+    job.probes = probes;
+    job.cnt = cnt;
+
+    pthread_mutex_init(&job.mutex, NULL);
+    for(i = 0; i < imin(to_probe, ROM_PROBE_THREADS) - 1; ++i)
+    {
+        if(pthread_create(&threads[i], NULL, multirom_probe_roms_thread, &job) != 0)
+            break;
+        ++started;
+    }
+    multirom_probe_roms_thread(&job);
+    for(i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&job.mutex);
+}
+
+// Adds ROMs from roms_path to s->roms, sorted by name. ROMs whose folder
+// did not change since the last scan are taken from the ROM index file.
+static int multirom_scan_roms_dir(struct multirom_status *s, const char *roms_path, struct usb_partition *part)
+{
+    list_buf probes = { NULL, 0, 0 };
+    list_buf add_roms = { NULL, 0, 0 };
+    struct rom_index_entry *e;
+    struct multirom_rom *rom;
+    struct rom_probe *p;
+    struct dirent *dr;
+    char path[256];
+    int dfd, hits = 0;
+    map *index;
+    DIR *d;
+
+    d = opendir(roms_path);
+    if(!d)
+        return -1;
+
+    dfd = dirfd(d);
+    index = multirom_load_rom_index(dfd);
+
+    while((dr = readdir(d)))
+    {
+        if(dr->d_name[0] == '.')
+            continue;
+
+        if(!part)
+        {
+            if(dr->d_type != DT_DIR)
+                continue;
+
+            if(strlen(dr->d_name) > MAX_ROM_NAME_LEN)
+            {
+                ERROR("Skipping ROM %s, name is too long (max %d chars allowed)\n", dr->d_name, MAX_ROM_NAME_LEN);
+                continue;
+            }
+        }
+
+        INFO("Adding ROM %s\n", dr->d_name);
+
+        rom = mzalloc(sizeof(struct multirom_rom));
+        rom->id = multirom_generate_rom_id();
+        rom->name = strdup(dr->d_name);
+        rom->partition = part;
+
+        snprintf(path, sizeof(path), "%s/%s", roms_path, rom->name);
+        rom->base_path = strdup(path);
+
+        p = mzalloc(sizeof(struct rom_probe));
+        p->rom = rom;
+        p->e.dir_mtime = multirom_stat_mtime(dfd, dr->d_name);
+        snprintf(path, sizeof(path), "%s/.icon_data", dr->d_name);
+        p->e.icon_mtime = multirom_stat_mtime(dfd, path);
+
+        e = map_get_val(index, rom->name);
+        if(e && p->e.dir_mtime >= 0 && e->dir_mtime == p->e.dir_mtime && e->icon_mtime == p->e.icon_mtime)
+        {
+            p->e = *e;
+            p->cached = 1;
+            ++hits;
+
+            rom->type = e->type;
+            rom->has_bootimg = e->has_bootimg;
+            multirom_set_rom_icon(rom, e->icon_type, e->icon_name);
+        }
+
+        list_buf_add(&probes, p);
+        list_buf_add(&add_roms, rom);
+    }
+
+    if(hits != probes.len)
+        multirom_probe_roms((struct rom_probe**)probes.items, probes.len, probes.len - hits);
+
+    // something was added, changed or removed
+    if(hits != probes.len || (size_t)hits != index->size)
+        multirom_save_rom_index(dfd, (struct rom_probe**)probes.items, probes.len);
+
+    map_destroy(index, &free);
+    closedir(d);
+    list_buf_clear(&probes, &free);
+
+    if(add_roms.len)
+    {
+        // sort roms
+        qsort(add_roms.items, add_roms.len, sizeof(struct multirom_rom*), compare_rom_names);
+
+        list_add_from_list(&s->roms, add_roms.items);
+        list_buf_clear(&add_roms, NULL);
+    }
+    return 0;
+}
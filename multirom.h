@@ -85,6 +85,18 @@ struct usb_partition
     int keep_mounted;
 };
 
+enum
+{
+    USB_EVENT_ADDED    = 0, // partition was mounted, ROMs not yet scanned
+    USB_EVENT_REMOVED  = 1, // partition is already out of status->partitions
+};
+
+struct usb_event
+{
+    int type;
+    struct usb_partition *part;
+};
+
 struct rom_info {
     // for future vals?
     map *str_vals;
@@ -160,6 +172,9 @@ int multirom_update_partitions(struct multirom_status *s);
 void multirom_destroy_partition(void *part);
 void multirom_set_usb_refresh_thread(struct multirom_status *s, int run);
 void multirom_set_usb_refresh_handler(void (*handler)(void));
+void multirom_request_usb_refresh(void);
+struct usb_event **multirom_take_usb_events(void);
+void multirom_apply_usb_event(struct multirom_status *s, struct usb_event *ev);
 int multirom_mount_usb(struct usb_partition *part);
 int multirom_copy_log(char *klog, const char *dest_path_relative);
 int multirom_scan_partition_for_roms(struct multirom_status *s, struct usb_partition *p);
@@ -191,7 +191,6 @@ int multirom_ui(struct multirom_status *s, struct multirom_rom **to_boot)
 
         if(loop_act & LOOP_UPDATE_USB && !ncard_is_moving())
         {
-            multirom_find_usb_roms(mrom_status);
             multirom_ui_tab_rom_update_usb();
             loop_act &= ~(LOOP_UPDATE_USB);
         }
@@ -379,7 +378,8 @@ void multirom_ui_switch(int tab)
     themes_info->data->selected_tab = tab;
 }
 
-int multirom_ui_fill_rom_list(listview *view, int mask)
+// part != NULL adds only ROMs from that partition
+static int multirom_ui_fill_rom_list_part(listview *view, int mask, struct usb_partition *part)
 {
     int i;
     int ret = 0;
@@ -390,7 +390,7 @@ int multirom_ui_fill_rom_list(listview *view, int mask)
     {
         rom = mrom_status->roms[i];
 
-        if(!(M(rom->type) & mask))
+        if(!(M(rom->type) & mask) || (part && rom->partition != part))
             continue;
 
         if(rom->partition)
@@ -406,6 +406,26 @@ int multirom_ui_fill_rom_list(listview *view, int mask)
     return ret;
 }
 
+int multirom_ui_fill_rom_list(listview *view, int mask)
+{
+    return multirom_ui_fill_rom_list_part(view, mask, NULL);
+}
+
+static void multirom_ui_rm_part_roms(listview *view, struct usb_partition *part)
+{
+    struct multirom_rom *rom;
+    int i;
+
+    for(i = 0; view->items && view->items[i];)
+    {
+        rom = multirom_get_rom_by_id(mrom_status, view->items[i]->id);
+        if(rom && rom->partition == part)
+            listview_rm_item(view, view->items[i]);
+        else
+            ++i;
+    }
+}
+
 static void multirom_ui_destroy_auto_boot_data(void)
 {
     if(auto_boot_data.b)
@@ -619,12 +639,25 @@ void multirom_ui_tab_rom_boot(void)
     pthread_mutex_unlock(&exit_code_mutex);
 }
 
+// Applies queued USB events, touching only rows of the affected partitions
 void multirom_ui_tab_rom_update_usb(void)
 {
     tab_data_roms *t = (tab_data_roms*)themes_info->data->tab_data[TAB_USB];
-    listview_clear(t->list);
+    struct usb_event **events = multirom_take_usb_events();
+    int i;
+
+    for(i = 0; events && events[i]; ++i)
+    {
+        if(events[i]->type == USB_EVENT_REMOVED)
+            multirom_ui_rm_part_roms(t->list, events[i]->part);
+
+        multirom_apply_usb_event(mrom_status, events[i]);
+
+        if(events[i]->type == USB_EVENT_ADDED)
+            multirom_ui_fill_rom_list_part(t->list, MASK_USB_ROMS, events[i]->part);
+    }
+    list_clear(&events, &free);
 
-    multirom_ui_fill_rom_list(t->list, MASK_USB_ROMS);
     listview_update_ui(t->list);
 
     multirom_ui_tab_rom_set_empty(t, (int)(t->list->items == NULL));
@@ -633,7 +666,7 @@ void multirom_ui_tab_rom_update_usb(void)
 
 void multirom_ui_tab_rom_refresh_usb(UNUSED int action)
 {
-    multirom_update_partitions(mrom_status);
+    multirom_request_usb_refresh();
 }
 
 void multirom_ui_tab_rom_set_empty(void *data, int empty)
@@ -241,23 +241,23 @@ char* convert_to_raw(char* str) {
 void rom_quirks_change_patch_and_osver() {
 
     char* path = "/system/build.prop";
-    struct bootimg primary_img;
+    struct boot_img_hdr primary_hdr;
     char* patchstring = NULL, *stringtoappend = NULL;
     char* existing_ver = NULL;
     char* existing_level = NULL;
     int sourcefile, destfile, n;
 
-    if (libbootimg_init_load(&primary_img, "/dev/block/bootdevice/by-name/boot", LIBBOOTIMG_LOAD_ALL) < 0)
+    // only the header is needed, don't read the whole partition
+    if (libbootimg_load_header(&primary_hdr, "/dev/block/bootdevice/by-name/boot") < 0)
     {
         return;
     }
 
-    char* primary_os_version = libbootimg_get_osversion(&primary_img.hdr, false);
-    char* primary_os_level = libbootimg_get_oslevel(&primary_img.hdr, false);
+    char* primary_os_version = libbootimg_get_osversion(&primary_hdr, false);
+    char* primary_os_level = libbootimg_get_oslevel(&primary_hdr, false);
 
-    char* primary_os_ver_raw = libbootimg_get_osversion(&primary_img.hdr, true);
-    char* primary_os_level_raw = libbootimg_get_oslevel(&primary_img.hdr, true);
-    libbootimg_destroy(&primary_img);
+    char* primary_os_ver_raw = libbootimg_get_osversion(&primary_hdr, true);
+    char* primary_os_level_raw = libbootimg_get_oslevel(&primary_hdr, true);
 
     sourcefile = open(path, O_RDONLY, 0644);
 
@@ -21,16 +21,20 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/sysmacros.h>
+#include <time.h>
 
 #include <fcntl.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
 #include <poll.h>
 #include <pthread.h>
 
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
 #include <linux/netlink.h>
 
 #ifdef HAVE_SELINUX
@@ -48,6 +52,7 @@
 #include "devices.h"
 #include "../lib/util.h"
 #include "../lib/log.h"
+#include "../lib/containers.h"
 
 //#define DEBUG_MISSING_UEVENTS 1
 
@@ -78,40 +83,99 @@ static struct selabel_handle *sehandle;
 
 extern const char *mr_init_devices[];
 
+#define UEVENT_SOCKET_SIZE      (256*1024)
+#define UEVENT_SOCKET_MAX_SIZE  (16*1024*1024)
+
 static int device_fd = -1;
+static int device_fd_size = 0;
+static volatile int device_fd_overflows = 0; // ENOBUFS seen, under uevent_mutex
+static int uevent_wake_fd = -1; // eventfd, wakes the uevent thread up on close
 static volatile int run_event_thread = 1;
 static pthread_t uevent_thread;
+// handle_device_fd() isn't reentrant, the uevent thread and the end of
+// coldboot both drain the socket
+static pthread_mutex_t uevent_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void firmware_pool_start(void);
+static void firmware_pool_stop(void);
+
+#define COLDBOOT_THREADS 4
+
+// Subdirectories of a recursive coldboot entry left to trigger. The pool
+// threads take them in FIFO order and push their own subdirectories back,
+// always after the parent's "add" has been written.
+struct coldboot_dir
+{
+    char *path;
+    int recursive;
+};
+
+static struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    list_buf dirs;
+    int busy; // threads which are processing a directory
+} coldboot = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .dirs = { NULL, 0, 0 },
+    .busy = 0,
+};
 
 static void *uevent_thread_work(UNUSED void *cookie)
 {
-    struct pollfd ufd;
+    struct pollfd ufds[2];
     int nr;
 
-    ufd.events = POLLIN;
-    ufd.fd = get_device_fd();
+    ufds[0].events = POLLIN;
+    ufds[0].fd = get_device_fd();
+    ufds[1].events = POLLIN;
+    ufds[1].fd = uevent_wake_fd;
 
     while(run_event_thread) {
-        ufd.revents = 0;
-        nr = poll(&ufd, 1, 0);
+        ufds[0].revents = 0;
+        nr = poll(ufds, 2, -1);
+        if (nr < 0 && errno != EINTR) {
+            ERROR("uevent: poll failed: %s\n", strerror(errno));
+            break;
+        }
 
-        if (nr > 0 && (ufd.revents & POLLIN))
+        if (nr > 0 && (ufds[0].revents & POLLIN)) {
+            pthread_mutex_lock(&uevent_mutex);
             handle_device_fd();
-
-        usleep(100000);
+            pthread_mutex_unlock(&uevent_mutex);
+        }
     }
     return NULL;
 }
 
-static void init_single_path(const char *path)
+static void coldboot_push(char *path, int recursive)
+{
+    struct coldboot_dir *d = mzalloc(sizeof(struct coldboot_dir));
+    d->path = path;
+    d->recursive = recursive;
+
+    pthread_mutex_lock(&coldboot.mutex);
+    list_buf_add(&coldboot.dirs, d);
+    pthread_cond_signal(&coldboot.cond);
+    pthread_mutex_unlock(&coldboot.mutex);
+}
+
+// Writes "add" to the dir's uevent file. The kernel queues the event
+// to the netlink socket before write() returns, the uevent thread
+// takes care of it from there.
+static void coldboot_trigger(struct coldboot_dir *cd)
 {
     int fd, dfd;
     DIR *d;
+    struct dirent *dr;
 
-    DEBUG("Initializing device %s\n", path);
-    d = opendir(path);
+    DEBUG("Initializing device %s\n", cd->path);
+    d = opendir(cd->path);
     if(!d)
     {
-        UEVENT_ERR("Failed to open folder %s\n", path);
+        UEVENT_ERR("Failed to open folder %s\n", cd->path);
         return;
     }
 
@@ -122,84 +186,192 @@ static void init_single_path(const char *path)
     {
         write(fd, "add\n", 4);
         close(fd);
-        handle_device_fd();
     }
     else
     {
-        UEVENT_ERR("Failed to open uevent at %s\n", path);
-    }
-
-    closedir(d);
-}
-
-static void init_folder(const char *path)
-{
-    init_single_path(path);
-
-    DIR *d = opendir(path);
-    if(!d)
-    {
-        UEVENT_ERR("Failed to open folder %s\n", path);
-        return;
+        UEVENT_ERR("Failed to open uevent at %s\n", cd->path);
     }
 
-    struct dirent *dr;
-    while((dr = readdir(d)))
+    while(cd->recursive && (dr = readdir(d)))
     {
         if (dr->d_type != DT_DIR ||
            (dr->d_name[0] == '.' && (dr->d_name[1] == 0 || dr->d_name[1] == '.')))
            continue;
 
-        char *p = malloc(strlen(path) + strlen(dr->d_name) + 2);
-        strcpy(p, path);
+        char *p = malloc(strlen(cd->path) + strlen(dr->d_name) + 2);
+        strcpy(p, cd->path);
         strcat(p, "/");
         strcat(p, dr->d_name);
 
-        init_folder(p);
-
-        free(p);
+        coldboot_push(p, 1);
     }
     closedir(d);
 }
 
-void devices_init(void)
+static void *coldboot_thread_work(UNUSED void *cookie)
 {
-    /* is 256K enough? udev uses 16MB! */
-    device_fd = uevent_open_socket(256*1024, true);
-    if(device_fd < 0)
+    struct coldboot_dir *d;
+
+    pthread_mutex_lock(&coldboot.mutex);
+    while(1)
+    {
+        if(coldboot.dirs.len == 0)
+        {
+            // nobody can push any more work, we're done
+            if(coldboot.busy == 0)
+                break;
+            pthread_cond_wait(&coldboot.cond, &coldboot.mutex);
+            continue;
+        }
+
+        d = coldboot.dirs.items[0];
+        list_buf_rm_at(&coldboot.dirs, 0, NULL);
+        ++coldboot.busy;
+        pthread_mutex_unlock(&coldboot.mutex);
+
+        coldboot_trigger(d);
+        free(d->path);
+        free(d);
+
+        pthread_mutex_lock(&coldboot.mutex);
+        --coldboot.busy;
+    }
+    // wake up the others so that they can exit too
+    pthread_cond_broadcast(&coldboot.cond);
+    pthread_mutex_unlock(&coldboot.mutex);
+    return NULL;
+}
+
+// Triggers the children a recursive entry pushed and waits until
+// all of them, and everything below them, are done.
+static void coldboot_run_children(void)
+{
+    pthread_t threads[COLDBOOT_THREADS];
+    int i, started = 0;
+
+    if(coldboot.dirs.len == 0)
         return;
 
-    fcntl(device_fd, F_SETFL, O_NONBLOCK);
+    for(i = 0; i < COLDBOOT_THREADS; ++i)
+    {
+        if(pthread_create(&threads[i], NULL, coldboot_thread_work, NULL) != 0)
+            break;
+        ++started;
+    }
+
+    // do it on this thread if none could be started
+    if(started == 0)
+        coldboot_thread_work(NULL);
+
+    for(i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+}
+
+static void coldboot_run_one(char *path, int recursive)
+{
+    struct coldboot_dir d = { path, recursive };
 
+    coldboot_trigger(&d);
+    free(path);
+
+    coldboot_run_children();
+}
+
+// The entries of mr_init_devices are triggered one by one in list order,
+// because the platform controllers come before their block devices there
+// and find_platform_device() needs them registered first. Only the subtrees
+// of recursive entries are spread over the pool.
+static void coldboot_run(void)
+{
     int i, len;
+
     for(i = 0; mr_init_devices[i]; ++i)
     {
         len = strlen(mr_init_devices[i]);
         if(mr_init_devices[i][len-1] != '*')
-            init_single_path(mr_init_devices[i]);
+            coldboot_run_one(strdup(mr_init_devices[i]), 0);
         else
-        {
-            char *path = strndup(mr_init_devices[i], len-1);
-            init_folder(path);
-            free(path);
-        }
+            coldboot_run_one(strndup(mr_init_devices[i], len-1), 1);
     }
 
     // /dev/null
-    init_single_path("/sys/devices/virtual/mem/null");
+    coldboot_run_one(strdup("/sys/devices/virtual/mem/null"), 0);
 
     // /dev/fuse
-    init_single_path("/sys/devices/virtual/misc/fuse");
+    coldboot_run_one(strdup("/sys/devices/virtual/misc/fuse"), 0);
+}
+
+void devices_init(void)
+{
+    struct timespec start, end;
+    int i, overflows;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* is 256K enough? udev uses 16MB! It grows on overflow. */
+    device_fd = uevent_open_socket(UEVENT_SOCKET_SIZE, true);
+    if(device_fd < 0)
+        return;
+    device_fd_size = UEVENT_SOCKET_SIZE;
+
+    fcntl(device_fd, F_SETFL, O_NONBLOCK);
+
+    uevent_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(uevent_wake_fd < 0)
+    {
+        ERROR("Failed to create uevent eventfd: %s\n", strerror(errno));
+        close(device_fd);
+        device_fd = -1;
+        return;
+    }
+
+    firmware_pool_start();
 
+    // Events are handled by the uevent thread while the pool is still
+    // triggering them, instead of draining the socket after every write.
     run_event_thread = 1;
     pthread_create(&uevent_thread, NULL, uevent_thread_work, NULL);
+
+    for(i = 0; i < 2; ++i)
+    {
+        overflows = device_fd_overflows;
+
+        coldboot_run();
+
+        // All coldboot events are queued by now, handle whatever the uevent
+        // thread didn't get to yet so that all nodes exist when we return.
+        pthread_mutex_lock(&uevent_mutex);
+        handle_device_fd();
+        pthread_mutex_unlock(&uevent_mutex);
+
+        // The triggers outran the uevent thread and the kernel dropped some
+        // events, which can't be recovered. The socket has grown since,
+        // so trigger everything once more.
+        if(device_fd_overflows == overflows)
+            break;
+        ERROR("uevent socket overflowed during coldboot, running it again\n");
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    INFO("Coldboot took %u ms\n", timespec_diff(&start, &end));
 }
 
 void devices_close(void)
 {
+    uint64_t val = 1;
+
+    if(device_fd < 0)
+        return;
+
     run_event_thread = 0;
+    write(uevent_wake_fd, &val, sizeof(val));
     pthread_join(uevent_thread, NULL);
 
+    // after the uevent thread, so that it can't queue any more requests
+    firmware_pool_stop();
+
+    close(uevent_wake_fd);
+    uevent_wake_fd = -1;
     close(device_fd);
     device_fd = -1;
 }
@@ -820,44 +992,58 @@ static void handle_device_event(struct uevent *uevent)
     }
 }
 
+/* plain read/write, for kernels which can't sendfile() into sysfs */
+static int copy_firmware(int fw_fd, int data_fd, off_t offset, off_t len_to_copy)
+{
+    char buf[PAGE_SIZE];
+    ssize_t nr, nw, done;
+
+    if (lseek(fw_fd, offset, SEEK_SET) < 0)
+        return -1;
+
+    while (len_to_copy > 0) {
+        nr = read(fw_fd, buf, sizeof(buf));
+        if (!nr)
+            break;
+        if (nr < 0)
+            return -1;
+
+        len_to_copy -= nr;
+        for (done = 0; done < nr; done += nw) {
+            nw = write(data_fd, buf + done, nr - done);
+            if (nw <= 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
 static int load_firmware(int fw_fd, int loading_fd, int data_fd)
 {
     struct stat st;
-    long len_to_copy;
+    off_t offset = 0;
+    ssize_t nw;
     int ret = 0;
 
     if(fstat(fw_fd, &st) < 0)
         return -1;
-    len_to_copy = st.st_size;
 
     write(loading_fd, "1", 1);  /* start transfer */
 
-    while (len_to_copy > 0) {
-        char buf[PAGE_SIZE];
-        ssize_t nr;
+    /* let the kernel move the data instead of bouncing it through
+     * a userspace buffer */
+    while (offset < st.st_size) {
+        nw = sendfile(data_fd, fw_fd, &offset, st.st_size - offset);
+        if (nw > 0)
+            continue;
 
-        nr = read(fw_fd, buf, sizeof(buf));
-        if(!nr)
-            break;
-        if(nr < 0) {
+        if (nw < 0 && (errno == EINVAL || errno == ENOSYS))
+            ret = copy_firmware(fw_fd, data_fd, offset, st.st_size - offset);
+        else if (nw < 0)
             ret = -1;
-            break;
-        }
-
-        len_to_copy -= nr;
-        while (nr > 0) {
-            ssize_t nw = 0;
-
-            nw = write(data_fd, buf + nw, nr);
-            if(nw <= 0) {
-                ret = -1;
-                goto out;
-            }
-            nr -= nw;
-        }
+        break;
     }
 
-out:
     if(!ret)
         write(loading_fd, "0", 1);  /* successful end of transfer */
     else
@@ -871,16 +1057,33 @@ static int is_booting(void)
     return access("/dev/.booting", F_OK) == 0;
 }
 
-static void process_firmware_event(struct uevent *uevent)
+/* The dirs are resolved on each request: encryption setup renames
+ * /vendor and mounts over /firmware, and cached dir fds would both
+ * point to the old dirs and keep /firmware busy. */
+static int open_firmware(const char *firmware)
+{
+    char path[PATH_MAX];
+    int fd = -1;
+    size_t i;
+
+    for (i = 0; fd < 0 && i < ARRAY_SIZE(firmware_dirs); i++) {
+        if (snprintf(path, sizeof(path), "%s/%s", firmware_dirs[i], firmware) >= (int)sizeof(path))
+            continue;
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    return fd;
+}
+
+static void process_firmware_event(const char *path, const char *firmware)
 {
     char *root, *loading, *data;
-    int l, loading_fd, data_fd, fw_fd, i;
+    int l, loading_fd, data_fd, fw_fd;
     int booting = is_booting();
 
     DEBUG("firmware: loading '%s' for '%s'\n",
-         uevent->firmware, uevent->path);
+         firmware, path);
 
-    l = asprintf(&root, SYSFS_PREFIX"%s/", uevent->path);
+    l = asprintf(&root, SYSFS_PREFIX"%s/", path);
     if (l == -1)
         return;
 
@@ -901,20 +1104,12 @@ static void process_firmware_event(struct uevent *uevent)
         goto loading_close_out;
 
 try_loading_again:
-    for (i = 0; i < ARRAY_SIZE(firmware_dirs); i++) {
-        char *file = NULL;
-        l = asprintf(&file, "%s/%s", firmware_dirs[i], uevent->firmware);
-        if (l == -1)
-            goto data_free_out;
-        fw_fd = open(file, O_RDONLY|O_CLOEXEC);
-        free(file);
-        if (fw_fd >= 0) {
-            if(!load_firmware(fw_fd, loading_fd, data_fd))
-                INFO("firmware: copy success { '%s', '%s' }\n", root, uevent->firmware);
-            else
-                INFO("firmware: copy failure { '%s', '%s' }\n", root, uevent->firmware);
-            break;
-        }
+    fw_fd = open_firmware(firmware);
+    if (fw_fd >= 0) {
+        if(!load_firmware(fw_fd, loading_fd, data_fd))
+            INFO("firmware: copy success { '%s', '%s' }\n", root, firmware);
+        else
+            INFO("firmware: copy failure { '%s', '%s' }\n", root, firmware);
     }
 
     if (fw_fd < 0) {
@@ -929,7 +1124,7 @@ try_loading_again:
             goto try_loading_again;
         }
 #endif
-        INFO("firmware: could not open '%s': %s\n", uevent->firmware, strerror(errno));
+        INFO("firmware: could not open '%s': %s\n", firmware, strerror(errno));
         write(loading_fd, "-1", 2);
         goto data_close_out;
     }
@@ -947,10 +1142,91 @@ root_free_out:
     free(root);
 }
 
+/* Firmware requests are served by a small pool of threads, so that
+ * the uevent thread isn't blocked by big blobs and nothing has to fork. */
+#define FIRMWARE_THREADS 2
+
+struct firmware_req {
+    char *path;
+    char *firmware;
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    list_buf reqs;
+    pthread_t threads[FIRMWARE_THREADS];
+    int thread_cnt;
+    int run;
+} firmware_pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .reqs = { NULL, 0, 0 },
+    .thread_cnt = 0,
+    .run = 0,
+};
+
+static void *firmware_thread_work(UNUSED void *cookie)
+{
+    struct firmware_req *req;
+
+    pthread_mutex_lock(&firmware_pool.mutex);
+    while (1) {
+        if (firmware_pool.reqs.len == 0) {
+            /* finish what was queued before exiting */
+            if (!firmware_pool.run)
+                break;
+            pthread_cond_wait(&firmware_pool.cond, &firmware_pool.mutex);
+            continue;
+        }
+
+        req = firmware_pool.reqs.items[0];
+        list_buf_rm_at(&firmware_pool.reqs, 0, NULL);
+        pthread_mutex_unlock(&firmware_pool.mutex);
+
+        process_firmware_event(req->path, req->firmware);
+        free(req->path);
+        free(req->firmware);
+        free(req);
+
+        pthread_mutex_lock(&firmware_pool.mutex);
+    }
+    pthread_mutex_unlock(&firmware_pool.mutex);
+    return NULL;
+}
+
+static void firmware_pool_start(void)
+{
+    int i;
+
+    firmware_pool.run = 1;
+    for (i = 0; i < FIRMWARE_THREADS; i++) {
+        if (pthread_create(&firmware_pool.threads[i], NULL, firmware_thread_work, NULL) != 0)
+            break;
+        ++firmware_pool.thread_cnt;
+    }
+
+    if (firmware_pool.thread_cnt == 0)
+        ERROR("firmware: failed to start any threads, requests will be handled inline\n");
+}
+
+static void firmware_pool_stop(void)
+{
+    int i;
+
+    pthread_mutex_lock(&firmware_pool.mutex);
+    firmware_pool.run = 0;
+    pthread_cond_broadcast(&firmware_pool.cond);
+    pthread_mutex_unlock(&firmware_pool.mutex);
+
+    for (i = 0; i < firmware_pool.thread_cnt; i++)
+        pthread_join(firmware_pool.threads[i], NULL);
+    firmware_pool.thread_cnt = 0;
+}
+
 static void handle_firmware_event(struct uevent *uevent)
 {
-    pid_t pid;
-    int ret;
+    struct firmware_req *req;
 
     if(strcmp(uevent->subsystem, "firmware"))
         return;
@@ -958,33 +1234,136 @@ static void handle_firmware_event(struct uevent *uevent)
     if(strcmp(uevent->action, "add"))
         return;
 
-    /* we fork, to avoid making large memory allocations in init proper */
-    pid = fork();
-    if (!pid) {
-        process_firmware_event(uevent);
-        _exit(EXIT_SUCCESS);
-    } else if (pid < 0) {
-        log_event_print("could not fork to process firmware event: %s\n", strerror(errno));
+    if (firmware_pool.thread_cnt == 0) {
+        process_firmware_event(uevent->path, uevent->firmware);
+        return;
     }
+
+    /* the uevent's strings point into the receive buffer, copy them */
+    req = mzalloc(sizeof(struct firmware_req));
+    req->path = strdup(uevent->path);
+    req->firmware = strdup(uevent->firmware);
+
+    pthread_mutex_lock(&firmware_pool.mutex);
+    list_buf_add(&firmware_pool.reqs, req);
+    pthread_cond_signal(&firmware_pool.cond);
+    pthread_mutex_unlock(&firmware_pool.mutex);
 }
 
 #define UEVENT_MSG_LEN  2048
+
+#if PLATFORM_SDK_VERSION >= 21
+#define UEVENT_BATCH    16
+#define uevent_mmsghdr  mmsghdr
+#define uevent_recvmmsg recvmmsg
+#else
+/* no recvmmsg() in older bionic, receive one message at a time */
+#define UEVENT_BATCH    1
+struct uevent_mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+
+static int uevent_recvmmsg(int fd, struct uevent_mmsghdr *hdr, UNUSED unsigned int vlen,
+        int flags, UNUSED struct timespec *timeout)
+{
+    ssize_t n = recvmsg(fd, &hdr->msg_hdr, flags);
+    if (n < 0)
+        return -1;
+    hdr->msg_len = n;
+    return 1;
+}
+#endif
+
+/* The kernel dropped some events because the socket was full, make
+ * room so that the next storm (e.g. an USB hub enumerating) fits. */
+static void grow_device_fd(void)
+{
+    int size = device_fd_size*2;
+
+    if (device_fd_size >= UEVENT_SOCKET_MAX_SIZE) {
+        ERROR("uevent socket overflowed, some events were lost\n");
+        return;
+    }
+
+    if (setsockopt(device_fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0) {
+        ERROR("uevent socket overflowed and growing it failed: %s\n", strerror(errno));
+        return;
+    }
+
+    device_fd_size = size;
+    ERROR("uevent socket overflowed, some events were lost. Grown to %d KB\n", size/1024);
+}
+
+/* same checks as uevent_kernel_multicast_recv() */
+static int is_kernel_uevent(struct msghdr *hdr)
+{
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+    struct sockaddr_nl *addr = hdr->msg_name;
+
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_CREDENTIALS)
+        return 0;
+
+    if (((struct ucred *)CMSG_DATA(cmsg))->uid != 0)
+        return 0;
+
+    return addr->nl_groups != 0 && addr->nl_pid == 0;
+}
+
+/* Callers are serialized by uevent_mutex, so the buffers can be static */
 void handle_device_fd(void)
 {
-    char msg[UEVENT_MSG_LEN+2];
-    int n;
-    while ((n = uevent_kernel_multicast_recv(device_fd, msg, UEVENT_MSG_LEN)) > 0) {
-        if(n >= UEVENT_MSG_LEN)   /* overflow -- discard */
-            continue;
+    static char msg[UEVENT_BATCH][UEVENT_MSG_LEN+2];
+    static char control[UEVENT_BATCH][CMSG_SPACE(sizeof(struct ucred))];
+    static struct sockaddr_nl addr[UEVENT_BATCH];
+    struct iovec iov[UEVENT_BATCH];
+    struct uevent_mmsghdr hdr[UEVENT_BATCH];
+    struct uevent uevent;
+    int i, n, len;
+
+    while (1) {
+        memset(hdr, 0, sizeof(hdr));
+        for (i = 0; i < UEVENT_BATCH; ++i) {
+            iov[i].iov_base = msg[i];
+            iov[i].iov_len = UEVENT_MSG_LEN;
+            hdr[i].msg_hdr.msg_name = &addr[i];
+            hdr[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+            hdr[i].msg_hdr.msg_iov = &iov[i];
+            hdr[i].msg_hdr.msg_iovlen = 1;
+            hdr[i].msg_hdr.msg_control = control[i];
+            hdr[i].msg_hdr.msg_controllen = sizeof(control[i]);
+        }
+
+        n = uevent_recvmmsg(device_fd, hdr, UEVENT_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == ENOBUFS) {
+                ++device_fd_overflows;
+                grow_device_fd();
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            break; /* EAGAIN, all read */
+        }
+        if (n == 0)
+            break;
+
+        for (i = 0; i < n; ++i) {
+            len = hdr[i].msg_len;
+            if (len >= UEVENT_MSG_LEN)   /* overflow -- discard */
+                continue;
 
-        msg[n] = '\0';
-        msg[n+1] = '\0';
+            if (!is_kernel_uevent(&hdr[i].msg_hdr))
+                continue;
+
+            msg[i][len] = '\0';
+            msg[i][len+1] = '\0';
 
-        struct uevent uevent;
-        parse_event(msg, &uevent);
+            parse_event(msg[i], &uevent);
 
-        handle_device_event(&uevent);
-        handle_firmware_event(&uevent);
+            handle_device_event(&uevent);
+            handle_firmware_event(&uevent);
+        }
     }
 }
 
@@ -177,14 +177,11 @@ static int mount_and_run(struct fstab *fstab)
         return -1;
     }
 
+    // run_core() has already waited for it
     if(access(datap->device, R_OK) < 0)
     {
-        INFO("Waiting for %s because error %s\n", datap->device, strerror(errno));
-        if(wait_for_file(datap->device, 5) < 0)
-        {
-            ERROR("Waiting too long for dev %s\n", datap->device);
-            return -1;
-        }
+        ERROR("Waiting too long for dev %s: %s\n", datap->device, strerror(errno));
+        return -1;
     }
 
     mkdir(REALDATA, 0755);
@@ -337,14 +334,32 @@ static int run_core(void)
 {
     int res = -1;
     struct fstab *fstab = NULL;
+    struct fstab_part *datap;
+    const char *wait_files[] = { "/dev/graphics/fb0", NULL, NULL };
+
+    fstab = fstab_auto_load();
 
-    if(wait_for_file("/dev/graphics/fb0", 5) < 0)
+    // wait for fb0 and the /data device at the same time,
+    // mount_and_run() reports a missing /data device itself.
+    datap = fstab ? fstab_find_first_by_path(fstab, "/data") : NULL;
+    if(datap)
+        wait_files[1] = datap->device;
+
+    if(wait_for_files(wait_files, 5000) < 0 && access(wait_files[0], F_OK) < 0)
     {
         ERROR("Waiting too long for fb0");
         goto exit;
     }
 
-    fstab = fstab_auto_load();
+    // fb0 may have used up most of the shared wait, give the
+    // /data device its own 5s like it used to have.
+    if(datap && access(datap->device, F_OK) < 0)
+    {
+        wait_files[0] = datap->device;
+        wait_files[1] = NULL;
+        wait_for_files(wait_files, 5000);
+    }
+
     if(!fstab)
         goto exit;
 